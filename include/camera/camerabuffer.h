@@ -22,6 +22,55 @@ public:
 		u16	B;
 	};
 
+	/// \brief Output pixel formats of Convert()
+	enum TPixelFormat
+	{
+		PixelFormatRGB565,	///< 16 bits per pixel, as used by the screen with DEPTH 16
+		PixelFormatRGB888,	///< 3 bytes per pixel in the order R, G, B
+		PixelFormatBGRA8888,	///< 4 bytes per pixel in the order B, G, R, A (alpha = 0xFF),
+					///< as used by the screen with DEPTH 32
+		PixelFormatGray8,	///< 1 byte per pixel, luminance only
+		PixelFormatGray16,	///< 2 bytes per pixel, luminance only
+		PixelFormatYUYV,	///< 2 bytes per pixel in the order Y0, U, Y1, V (YUV 4:2:2)
+		PixelFormatNV12,	///< Y plane, followed by an U/V interleaved plane (YUV 4:2:0)
+		PixelFormatI420,	///< Y plane, followed by an U plane and a V plane (YUV 4:2:0)
+		PixelFormatUnknown
+	};
+
+	/// \brief Statistics of a frame, calculated by GetStatistics()
+	/// \note The statistics are calculated from the Bayer quads of the raw frame
+	///	  (before white balance, color correction and gamma), where the two green
+	///	  values of a quad are averaged. Y is the luminance (BT.601) of a quad.
+	/// \note The channel index of Sum[], Histogram[] and TZone::Sum[] is 0 for R,
+	///	  1 for G, 2 for B and 3 for Y. The values have the depth of the frame.
+	struct TStatistics
+	{
+		static const unsigned MaxBins = 256;
+		static const unsigned MaxZonesX = 16;
+		static const unsigned MaxZonesY = 16;
+
+		struct TZone
+		{
+			u32	 Sum[4];	///< Sum of the values of the sampled quads
+			unsigned Count;		///< Number of sampled quads
+			unsigned Saturated;	///< Number of quads with a saturated channel
+		};
+
+		// must be set by the caller
+		unsigned Bins;			///< Number of histogram bins (power of 2, 1 .. MaxBins)
+		unsigned Stride;		///< Sample every Stride-th quad in both directions
+		unsigned ZonesX;		///< Number of zones horizontally (1 .. MaxZonesX)
+		unsigned ZonesY;		///< Number of zones vertically (1 .. MaxZonesY)
+
+		// set by GetStatistics()
+		unsigned Depth;			///< Number of valid bits of the values
+		unsigned Count;			///< Number of sampled quads
+		u64	 Sum[4];		///< Sum of the values of the sampled quads
+		unsigned Saturated[3];		///< Number of quads with a saturated R, G or B value
+		u32	 Histogram[4][MaxBins];	///< First Bins entries valid per channel
+		TZone	 Zone[MaxZonesY][MaxZonesX];	///< First ZonesY x ZonesX entries valid
+	};
+
 public:
 	CCameraBuffer (void);
 	~CCameraBuffer (void);
@@ -37,7 +86,8 @@ public:
 	u32 GetPixelRGB888 (unsigned x, unsigned y);
 	/// \brief Convert frame to RGB888-coded image
 	/// \param pOutBuffer Write image to this location in main memory
-	void ConvertToRGB888 (void *pOutBuffer);
+	/// \param bHalfResolution Calculate one output pixel per Bayer quad (see ConvertScaled())
+	void ConvertToRGB888 (void *pOutBuffer, bool bHalfResolution = false);
 
 	/// \param x 0-based horizontal pixel coordinate
 	/// \param y 0-based vertical pixel coordinate
@@ -45,28 +95,116 @@ public:
 	u16 GetPixelRGB565 (unsigned x, unsigned y);
 	/// \brief Convert frame to RGB565-coded image
 	/// \param pOutBuffer Write image to this location in main memory
-	void ConvertToRGB565 (void *pOutBuffer);
+	/// \param bHalfResolution Calculate one output pixel per Bayer quad (see ConvertScaled())
+	void ConvertToRGB565 (void *pOutBuffer, bool bHalfResolution = false);
+
+	/// \brief Convert (a region of) the frame to an 8-bit grayscale image
+	/// \param pOutBuffer Write image to this location in main memory
+	/// \param nPitch Number of bytes from one output line to the next (0 for image width)
+	/// \param bHalfResolution Calculate one output pixel per Bayer quad
+	/// \param pSourceRect Region of the frame to be converted (nullptr for the whole frame)
+	void ConvertToGray8 (void *pOutBuffer, unsigned nPitch = 0, bool bHalfResolution = false,
+			     const CCameraDevice::TRect *pSourceRect = nullptr);
+	/// \brief Convert (a region of) the frame to a 16-bit grayscale image
+	/// \param pOutBuffer Write image to this location in main memory
+	/// \param nPitch Number of bytes from one output line to the next (0 for image width)
+	/// \param bHalfResolution Calculate one output pixel per Bayer quad
+	/// \param pSourceRect Region of the frame to be converted (nullptr for the whole frame)
+	void ConvertToGray16 (void *pOutBuffer, unsigned nPitch = 0, bool bHalfResolution = false,
+			      const CCameraDevice::TRect *pSourceRect = nullptr);
+
+	/// \brief Convert a region of the frame directly into a (frame) buffer
+	/// \param pOutBuffer Write the top-left pixel of the region to this location
+	/// \param nPitch Number of bytes from one output line to the next
+	/// \param Format Output pixel format
+	/// \param pSourceRect Region of the frame to be converted (nullptr for the whole frame)
+	/// \note The source region must be completely inside of the frame.
+	/// \note The RGB and YUV formats are demosaiced with the method, which is selected
+	///	  with CCameraDevice::SetDemosaicMethod().
+	/// \note The gray formats are calculated directly from the 2x2 Bayer window,
+	///	  which starts at the respective pixel, without demosaicing. The black
+	///	  level and lens shading correction is applied to the window values.
+	/// \note The YUV formats use BT.601 limited range coefficients. Their chroma is
+	///	  calculated from the Bayer quads, so Left, Top, Width and Height of the
+	///	  source region must be even. The chroma planes of NV12 and I420 directly
+	///	  follow the Y plane (nPitch * Height bytes) with a pitch of nPitch (NV12)
+	///	  or nPitch / 2 (I420).
+	void Convert (void *pOutBuffer, unsigned nPitch, TPixelFormat Format,
+		      const CCameraDevice::TRect *pSourceRect = nullptr);
+
+	/// \brief Convert the frame into a downscaled image by binning the Bayer quads
+	/// \param pOutBuffer Write the top-left pixel of the image to this location
+	/// \param nPitch Number of bytes from one output line to the next
+	/// \param Format Output pixel format
+	/// \param nScale Downscaling divisor (2, 4 or 8)
+	/// \param pSourceRect Region of the frame to be converted (nullptr for the whole frame)
+	/// \note Each output pixel is the average of the nScale x nScale source pixels.
+	///	  The output image has (Width / nScale) x (Height / nScale) pixels.
+	/// \note With nScale 2 each Bayer quad gives exactly one pixel (superpixel), with
+	///	  the R and B values and the average of the two green values of the quad.
+	///	  There is no interpolation, so this is much faster than Convert().
+	/// \note Left and Top of the source region must be even.
+	/// \note The YUV formats are not supported here.
+	void ConvertScaled (void *pOutBuffer, unsigned nPitch, TPixelFormat Format, unsigned nScale = 2,
+			    const CCameraDevice::TRect *pSourceRect = nullptr);
 
 	/// \brief Apply white balance algorithm (improved White Patch method)
 	/// \param N Number of pixels, the White Patch method is applied to
 	/// \param M Number of samples taken
 	/// \note See: N. Banic, S. Loncaric: Improving the White Patch method by sampling
+	/// \note This applies to this buffer only. ControlAutoWhiteBalance (on Camera Module 2)
+	///	  or CCameraDevice::SetWhiteBalance() apply to all following frames.
+	/// \note This modifies the buffer and must not be called, while the buffer is
+	///	  used by another consumer.
 	void WhiteBalance (unsigned N = 50, unsigned M = 10);
 
+	/// \brief Calculate the statistics of the frame in a single pass over the raw data
+	/// \param pStats Pointer to caller-owned statistics, with the input fields set
+	/// \note The frame is split into ZonesX x ZonesY zones of (nearly) equal size,
+	///	  which are a multiple of Bayer quads.
+	void GetStatistics (TStatistics *pStats) const;
+
+	/// \brief Estimate the white balance factors from the statistics of a frame
+	/// \param Stats Statistics with a grid of zones (e.g. 16 x 12)
+	/// \param nBlackLevel Black level of the values in the statistics
+	/// \param pFactor Gets the R, G and B factors (65536 = 1.0, G is always 1.0)
+	/// \return Estimation successful? (fails, if all zones are too dark or saturated)
+	/// \note The result is the mean of a grey-world and a white-patch estimation, both
+	///	  calculated from the zones, without the dark and the saturated ones.
+	static bool EstimateWhiteBalance (const TStatistics &Stats, unsigned nBlackLevel,
+					  unsigned pFactor[3]);
+
 	/// \return 0-based sequence number of the frame
 	unsigned GetSequenceNumber (void) const;
 	/// \return Microseconds timestamp of the frame
 	unsigned GetTimestamp (void) const;
 
+	/// \brief Take an additional reference to this buffer (e.g. for another consumer)
+	/// \note This is allowed for buffers, which have been got from
+	///	  CCameraDevice::DequeueBuffer() and have not been returned yet. Each
+	///	  reference must be dropped with CCameraDevice::QueueBuffer().
+	/// \note The reference count is updated atomically and can be used from all cores.
+	void AddReference (void);
+
 	/// \return Pointer to the frame buffer
-	/// \note The image is in unpacked 10-bit Bayer format. One pixel occupies two bytes.
+	/// \note The image is in the Bayer format reported by CCameraDevice::GetFormatInfo().
+	/// \note The defective pixels from the defect map of the device are patched in place,
+	///	  before the buffer is handed out by the device.
 	void *GetPtr (void) const;
 
 private:
-	bool Setup (size_t nSize);
+	bool Setup (size_t nSize, const CCameraDevice *pDevice);
+	bool Setup (void *pMemory, size_t nSize, const CCameraDevice *pDevice);	// not owned
 	void InvalidateCache (void);
 	friend class CCameraDevice;
 
+	// corrects the defects and sets up the color tables for the conversions,
+	// the buffer is only read afterwards, so that it can be shared by consumers
+	void Prepare (void);
+
+	void FindDefects (unsigned nThreshold, CCameraDevice *pDevice) const;
+	void CorrectDefects (void);
+
 	uintptr GetDMAAddress (void) const;
 	void SetSequenceNumber (unsigned nSequence);
 	void SetTimestamp (unsigned nTimestamp);
@@ -74,20 +212,128 @@ private:
 			CCameraDevice::TFormatCode Format);
 	friend class CCSI2CameraDevice;
 
+private:
+	static const unsigned SpanMax = 256;	// pixels processed in one go by the kernels
+
+	struct TSpan				// color components of a pixel span
+	{
+		u16	R[SpanMax];
+		u16	G[SpanMax];
+		u16	B[SpanMax];
+	};
+
+	struct TConvertJob
+	{
+		CCameraBuffer		*pThis;
+		TPixelFormat		 Format;
+		u8			*pOutBuffer;
+		unsigned		 nPitch;	// bytes per output line
+		CCameraDevice::TRect	 Rect;		// source region
+		unsigned		 nScaleShift;	// 0 for full resolution
+	};
+
+	// may be split into bands and executed on multiple cores
+	void ConvertFrame (TConvertJob *pJob);
+	void ConvertRows (const TConvertJob *pJob, unsigned nFirstRow, unsigned nLastRow);
+	void ConvertRowsYUV (const TConvertJob *pJob, unsigned nFirstPair, unsigned nLastPair);
+	static void ConvertRowsStub (unsigned nFirstRow, unsigned nLastRow, void *pParam);
+
+	void PrefetchLines (unsigned x, unsigned y, unsigned nCount, unsigned nLines,
+			    unsigned nStep) const;
+
+	TPixel GetCorrectedPixel (unsigned x, unsigned y);
+
+	// positions of the color components inside of a Bayer quad
+	void GetQuadPositions (unsigned nPosX[4], unsigned nPosY[4]) const;
+
+	void DemosaicSpan (unsigned x, unsigned y, unsigned nCount, TSpan *pSpan) const;
+
+	// 5x5 gradient-corrected demosaic from five line buffers
+	void DemosaicSpanGradient (const u16 *const pLine[5], unsigned x, unsigned y,
+				   unsigned nCount, TSpan *pSpan) const;
+	void FetchWindow (unsigned x, unsigned y, unsigned nCount, u16 *pLine[5]) const;
+	void FetchLine (unsigned x, int nLine, unsigned nCount, u16 *pOut) const;
+
+	struct TLineRing		// unpacked source lines of a tile for the gradient demosaic
+	{
+		static const unsigned Lines = 6;		// y-2 .. y+3 for the rows y and y+1
+		static const unsigned MaxWidth = 1024 + 4;	// tile width and 2 columns each side
+
+		u16	 Line[Lines][MaxWidth];
+		unsigned nFirst;	// index of line y-2 in Line[]
+		int	 nRow;		// y (-1 if empty)
+		unsigned nX;		// tile position and width
+		unsigned nCount;
+	};
+
+	void AdvanceRing (TLineRing *pRing, unsigned x, unsigned y, unsigned nCount) const;
+	void DemosaicSpanRing (const TLineRing &Ring, unsigned x, unsigned y, unsigned nCount,
+			       TSpan *pSpan) const;
+	void BinSpan (unsigned x, unsigned y, unsigned nCount, unsigned nScaleShift,
+		      TSpan *pSpan) const;
+
+	u8 *GraySpan (unsigned x, unsigned y, unsigned nCount, TPixelFormat Format, u8 *pOut) const;
+	void GetLumaFactors (unsigned nFactor[3]) const;
+
+	// color correction matrix and lookup tables from Bayer values to white balanced,
+	// gamma corrected 8-bit values
+	void UpdateColorTables (void);
+	void CorrectSpan (TSpan *pSpan, unsigned nCount) const;
+
+	// black level and lens shading correction
+	int GetStretchFactor (void) const;
+	void GetRowGains (unsigned y, int nStretch,
+			  int RowGain[3][CCameraDevice::TLensShading::GridWidth + 1]) const;
+	void GetShadingGains (unsigned x, unsigned y, unsigned nCount,
+			      unsigned Gain[3][SpanMax]) const;
+	void ShadeSpan (unsigned x, unsigned y, unsigned nCount, unsigned nScaleShift,
+			TSpan *pSpan) const;
+	void ShadeColors (unsigned x, unsigned y, unsigned nCount, unsigned nScaleShift,
+			  u16 *const pColor[3]) const;
+
+	u8 *PackSpan (const TSpan &Span, unsigned nCount, TPixelFormat Format, u8 *pOut) const;
+	void PackRGB888 (const TSpan &Span, unsigned nCount, u8 *pOut) const;
+	void PackRGB565 (const TSpan &Span, unsigned nCount, u16 *pOut) const;
+	void PackBGRA8888 (const TSpan &Span, unsigned nCount, u32 *pOut) const;
+	void PackGray (const TSpan &Span, unsigned nCount, TPixelFormat Format, u8 *pOut) const;
+	void PackLuma (const TSpan &Span, unsigned nCount, u8 *pY) const;
+	void PackChroma (const TSpan &Span, unsigned nCount, u8 *pU, u8 *pV, unsigned nStep) const;
+
 private:
 	size_t m_nSize;
 	u8 *m_pBuffer;
+	bool m_bOwnBuffer;		// allocated by Setup()?
 
 	unsigned m_nSequence;
 	unsigned m_nTimestamp;
 
+	volatile int m_nRefCount;	// held by the application, if > 0
+
 	unsigned m_nWidth;
 	unsigned m_nHeight;
 	unsigned m_nBytesPerLine;
 	CCameraDevice::TFormatCode m_Format;
 
 	unsigned m_ColorFactor[3];	// R, G, B
+	bool m_bPrepared;		// this frame by Prepare()
 	unsigned m_nSeed;
+
+	const CCameraDevice *m_pDevice;
+
+	s16 m_ColorMatrix[3][3];		// with the white balance factors folded in
+	bool m_bColorMatrix;
+
+	unsigned m_nBlackLevel;			// for the depth of the frame
+	const CCameraDevice::TLensShading *m_pLensShading;
+	bool m_bShading;			// black level or lens shading correction?
+
+	CCameraDevice::TDemosaicMethod m_DemosaicMethod;	// of the current conversion
+
+	static const unsigned LUTSize = 1024;	// 10 bits depth at most
+	u8 m_LUT[3][LUTSize];			// R, G, B
+	unsigned m_LUTFactor[3];		// m_ColorFactor[], the LUT is valid for
+	unsigned m_nLUTDepth;
+	unsigned m_nLUTGeneration;		// of the tone curve of the device
 };
 
 #endif
@@ -12,8 +12,13 @@
 #include <camera/cameracontrol.h>
 #include <circle/device.h>
 #include <circle/string.h>
+#include <circle/sysconfig.h>
 #include <circle/types.h>
 
+#ifdef NO_BUSY_WAIT
+	#include <circle/sched/synchronizationevent.h>
+#endif
+
 #define CAMERA_FORMAT_CODE(tl, tr, bl, br, d, p) ((u16) ((d)-1)    | \
 						  (u16) (tl) << 4  | \
 						  (u16) (tr) << 6  | \
@@ -48,10 +53,10 @@ public:
 		FormatSGBRG10	= CAMERA_FORMAT_CODE (GB, B, R, GR, 10, 0),	///< occupies 16 bits
 		FormatSGRBG10	= CAMERA_FORMAT_CODE (GR, R, B, GB, 10, 0),	///< occupies 16 bits
 		FormatSRGGB10	= CAMERA_FORMAT_CODE (R, GR, GB, B, 10, 0),	///< occupies 16 bits
-		FormatSBGGR10P	= CAMERA_FORMAT_CODE (B, GB, GR, R, 10, 1),
-		FormatSGBRG10P	= CAMERA_FORMAT_CODE (GB, B, R, GR, 10, 1),
-		FormatSGRBG10P	= CAMERA_FORMAT_CODE (GR, R, B, GB, 10, 1),
-		FormatSRGGB10P	= CAMERA_FORMAT_CODE (R, GR, GB, B, 10, 1),
+		FormatSBGGR10P	= CAMERA_FORMAT_CODE (B, GB, GR, R, 10, 1),	///< 4 pixels in 5 bytes
+		FormatSGBRG10P	= CAMERA_FORMAT_CODE (GB, B, R, GR, 10, 1),	///< 4 pixels in 5 bytes
+		FormatSGRBG10P	= CAMERA_FORMAT_CODE (GR, R, B, GB, 10, 1),	///< 4 pixels in 5 bytes
+		FormatSRGGB10P	= CAMERA_FORMAT_CODE (R, GR, GB, B, 10, 1),	///< 4 pixels in 5 bytes
 		FormatUnknown	= 0
 	};
 
@@ -113,9 +118,9 @@ public:
 		ControlAnalogGain,
 		ControlDigitalGain,		///< Camera Module 2 only
 
-		ControlAutoExposure,		///< Camera Module 1 only
-		ControlAutoGain,		///< Camera Module 1 only
-		ControlAutoWhiteBalance,	///< Camera Module 1 only
+		ControlAutoExposure,		///< in software with Camera Module 2
+		ControlAutoGain,		///< in software with Camera Module 2
+		ControlAutoWhiteBalance,	///< in software with Camera Module 2
 
 		ControlTestPattern,		///< Camera Module 2 only
 		ControlTestPatternRed,		///< Camera Module 2 only
@@ -126,6 +131,62 @@ public:
 		ControlUnknown
 	};
 
+	/// \brief Demosaic methods of the RGB and YUV conversions
+	enum TDemosaicMethod
+	{
+		DemosaicBilinear,	///< 3x3 bilinear interpolation (fastest)
+		DemosaicGradient,	///< 5x5 gradient-corrected linear interpolation
+					///< (Malvar-He-Cutler), less zipper artefacts on edges
+		DemosaicUnknown
+	};
+
+	/// \brief Policies of the queue of ready buffers
+	enum TQueuePolicy
+	{
+		QueueFIFO,		///< all frames in order, new frames are dropped, if the
+					///< queue is full (e.g. for recording)
+		QueueLatest,		///< the newest frame overwrites the oldest unconsumed
+					///< one (e.g. for preview and control loops)
+		QueueUnknown
+	};
+
+	/// \brief Counters of the frame delivery, since start or ResetFrameStatistics()
+	struct TFrameStatistics
+	{
+		static const unsigned LatencyBins = 10;
+
+		unsigned FramesReceived;	///< Frames ended (incl. the dropped ones)
+		unsigned FramesDelivered;	///< Frames got by the application
+		unsigned FramesDroppedNoBuffer;	///< No free buffer at frame start
+		unsigned FramesDroppedFlush;	///< Dropped by FlushBuffers() (incl. the held one)
+		unsigned FramesOverwritten;	///< Replaced by newer frames with QueueLatest
+
+		unsigned QueueDepthMin;		///< Ready buffers, sampled on each frame end
+		float	 QueueDepthAvg;
+		unsigned QueueDepthMax;
+
+		/// Latency from frame start to delivery: bin 0 < 1 ms, bin n < 2^n ms,
+		/// the last bin counts the longer latencies too.
+		unsigned LatencyHistogram[LatencyBins];
+	};
+
+	/// \brief Color correction matrix: (R', G', B') = Coeff * (R, G, B)
+	struct TColorMatrix
+	{
+		s16	Coeff[3][3];	///< row-major, 10 fractional bits (1024 = 1.0)
+	};
+
+	/// \brief Lens shading correction: gain grid, spread uniformly over the frame
+	/// \note The first and last grid points are located at the frame borders.
+	///	  The gains between them are interpolated bilinearly.
+	struct TLensShading
+	{
+		static const unsigned GridWidth = 16;
+		static const unsigned GridHeight = 12;
+
+		u16	Gain[3][GridHeight][GridWidth];	///< R, G, B; 10 fractional bits (1024 = 1.0)
+	};
+
 	typedef void TBufferReadyHandler (unsigned nSequence, void *pParam);
 
 public:
@@ -138,12 +199,16 @@ public:
 	/// \brief Call this first to define the wanted image frame format
 	/// \param nWidth Wanted width of the frame in number of pixels
 	/// \param nHeight Wanted height of the frame in number of pixel lines
-	/// \param nDepth Number of valid bits in the color information (must be 10 currently)
+	/// \param nDepth Number of valid bits in the color information
+	///	  (10, or 8 with Camera Module 2, which occupies one byte per value)
+	/// \param bPacked Store 10-bit values packed as received (4 pixels in 5 bytes,
+	///	  Sxxxx10P formats), instead of occupying 16 bits each (ignored with 8 bits)
 	/// \return Operation successful?
 	/// \note The actual frame size may be different from the wanted one.
 	///	  Use GetFormatInfo() to get it.
 	/// \note Must not be called, when streaming active.
-	virtual bool SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth = 10) = 0;
+	virtual bool SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth = 10,
+				bool bPacked = false) = 0;
 
 	/// \return Information about the actual image frame format.
 	/// \note Must be called after SetFormat().
@@ -155,6 +220,19 @@ public:
 	/// \return Operation successful?
 	/// \note Must be called after SetFormat(), because the buffer size is not known before.
 	bool AllocateBuffers (unsigned nBuffers = 3);
+	/// \brief Use memory regions of the caller as frame buffers for the camera
+	/// \param pMemory Start addresses of the regions (nBuffers entries)
+	/// \param nBuffers Number of buffers (3 .. 20)
+	/// \param nSize Size of each region in bytes (at least TFormatInfo::ImageSize)
+	/// \return Operation successful?
+	/// \note Must be called after SetFormat(), instead of AllocateBuffers() above.
+	/// \note The camera writes the frames directly into the regions (e.g. a frame buffer
+	///	  page or an encoder input), in the format reported by GetFormatInfo().
+	/// \note The regions must not overlap, must be aligned to DATA_CACHE_LINE_LENGTH_MAX,
+	///	  their size must be a multiple of it and they must be within the first GB of
+	///	  the memory, which is accessible for the DMA via BUS_ADDRESS().
+	/// \note The regions are not freed by FreeBuffers() and must stay valid until then.
+	bool AllocateBuffers (void *const pMemory[], unsigned nBuffers, size_t nSize);
 	/// \brief Free the frame buffers
 	/// \note Should be called after Stop(), when a Start() with the same format will not follow.
 	/// \note In Circle by default buffers with a size greater than 512K cannot be reused.
@@ -191,35 +269,237 @@ public:
 
 	/// \brief Get the next frame buffer, which is ready to process (filled with data)
 	/// \return Pointer to the buffer instance (or nullptr, if no buffer is available)
+	/// \note The same buffer is returned, until BufferProcessed() is called.
+	/// \note GetNextBuffer() and BufferProcessed() are intended for one consumer.
 	CCameraBuffer *GetNextBuffer (void);
 	/// \brief Wait for the next frame buffer, which is ready to process (filled with data)
 	/// \param nTimeoutMs Timeout in milliseconds (0 for forever)
 	/// \return Pointer to the buffer instance (or nullptr on timeout)
+	/// \note With the scheduler active on core 0, the calling task is blocked, until a
+	///	  buffer is ready (NO_BUSY_WAIT defined), or yields to the other tasks in
+	///	  between. Otherwise the core sleeps with WFE in between and is woken by the
+	///	  interrupt of the next frame.
 	CCameraBuffer *WaitForNextBuffer (unsigned nTimeoutMs = 1000);
 	/// \brief Return one (previously processed) buffer to the buffer queue
+	/// \note Automatic controls, which are implemented in software, are updated
+	///	  from the statistics of this buffer here.
 	void BufferProcessed (void);
 	/// \brief Return all ready buffers to the buffer queue
+	/// \note The buffer from GetNextBuffer() is returned too and must not be accessed
+	///	  afterwards, references taken with CCameraBuffer::AddReference() stay valid.
 	void FlushBuffers (void);
 
+	/// \brief Set the policy of the queue of ready buffers
+	/// \param Policy Queue policy (QueueFIFO by default)
+	/// \note With QueueLatest GetNextBuffer() and DequeueBuffer() return the most
+	///	  recent frame and the older ready ones are returned to the free buffers.
+	void SetQueuePolicy (TQueuePolicy Policy);
+	/// \return Policy of the queue of ready buffers
+	TQueuePolicy GetQueuePolicy (void) const;
+
+	/// \brief Remove the oldest ready frame buffer from the queue and hand it over
+	/// \return Pointer to the buffer instance (or nullptr, if no buffer is available)
+	/// \note Any number of buffers can be held by the application this way, while
+	///	  newer frames are captured into the remaining free buffers.
+	/// \note The caller holds one reference to the buffer. More references can be
+	///	  taken with CCameraBuffer::AddReference() for other consumers.
+	/// \note The defects of the frame are corrected and the color tables are set up
+	///	  here, so that the consumers only read the buffer.
+	CCameraBuffer *DequeueBuffer (void);
+	/// \brief Drop a reference to a buffer, which has been got from DequeueBuffer()
+	/// \param pBuffer Pointer to the buffer instance
+	/// \note The buffer is returned for capturing, when the last reference is dropped.
+	///	  The buffers can be returned in any order.
+	/// \note Automatic controls, which are implemented in software, are updated from
+	///	  the statistics of this buffer here, if it is the last dequeued one. If the
+	///	  last reference is dropped on another core, the statistics are taken there
+	///	  and the controls are updated on the next call of GetNextBuffer(),
+	///	  DequeueBuffer() or QueueBuffer() on core 0.
+	void QueueBuffer (CCameraBuffer *pBuffer);
+
+	/// \brief Get a snapshot of the frame delivery counters
+	/// \param pStatistics Pointer to the structure to be filled
+	/// \note Use it to size the number of buffers and to detect consumer stalls.
+	void GetFrameStatistics (TFrameStatistics *pStatistics) const;
+	/// \brief Set all frame delivery counters to zero
+	/// \note Must be called on core 0, which receives the camera interrupt.
+	void ResetFrameStatistics (void);
+
 	/// \brief Register a callback, which gets called, when a buffer is ready to process
 	/// \param pHandler Pointer to the handler (nullptr to unregister)
 	/// \param pParam User parameter, which will be handed over to the callback
 	void RegisterBufferReadyHandler (TBufferReadyHandler *pHandler, void *pParam);
 
+	/// \brief Set the gamma correction, applied by the RGB and YUV conversions
+	/// \param fGamma Gamma value (1.0 for linear output, 2.2 is typical for displays)
+	/// \note The conversions of CCameraBuffer fuse the white balance factors, clipping,
+	///	  this tone curve and the output quantisation into per-channel lookup tables.
+	void SetGamma (float fGamma);
+
+	/// \brief Set the white balance factors, which the following frames are converted with
+	/// \param pFactor R, G and B factors (65536 = 1.0)
+	/// \note With ControlAutoWhiteBalance enabled on Camera Module 2, these factors are
+	///	  adjusted in software from the statistics of each processed frame.
+	void SetWhiteBalance (const unsigned pFactor[3]);
+	/// \param pFactor Gets the current R, G and B white balance factors (65536 = 1.0)
+	void GetWhiteBalance (unsigned pFactor[3]) const;
+
+	/// \brief Set the black level, which is subtracted by the conversions
+	/// \param nLevel Black level for 10-bit values (scaled down for 8-bit frames)
+	/// \note The camera modules set the black level of their sensor.
+	/// \note The remaining range is stretched to full scale again.
+	void SetBlackLevel (unsigned nLevel);
+	/// \return Black level for 10-bit values
+	unsigned GetBlackLevel (void) const;
+
+	/// \brief Set the lens shading correction, applied by the conversions
+	/// \param pTable Pointer to the gain table (nullptr to disable lens shading correction)
+	/// \note The table is copied and can be calibrated for the used lens.
+	void SetLensShading (const TLensShading *pTable);
+	/// \return Pointer to the lens shading table (nullptr if disabled)
+	const TLensShading *GetLensShading (void) const;
+
+	/// \brief Detect defective (hot or dead) pixels in a frame and add them to the defect map
+	/// \param pBuffer Frame to be searched (e.g. a dark frame with the lens covered)
+	/// \param nThreshold Min. difference of a defective pixel to all of its neighbours
+	///	  with the same color (for 10-bit values, scaled down for 8-bit frames)
+	/// \return Number of defective pixels in the map
+	/// \note The frame is scanned once here. The defective pixels of all following
+	///	  frames are patched with the mean of their neighbours, before they are
+	///	  converted, so that the per-frame cost depends on the number of defects only.
+	/// \note The map is valid for the current frame format and flip settings only.
+	/// \note The pixels are patched in place in the frame buffer, once per frame in
+	///	  GetNextBuffer() or DequeueBuffer(), before the buffer is handed out. So all
+	///	  consumers see the patched raw data, also with CCameraBuffer::GetPtr() and
+	///	  CCameraBuffer::GetStatistics(). Call ClearDefects() before, if the
+	///	  unmodified sensor data is needed (e.g. for saving raw frames).
+	unsigned DetectDefects (CCameraBuffer *pBuffer, unsigned nThreshold = 128);
+	/// \brief Add a defective pixel to the defect map (e.g. from a calibration table)
+	/// \param x 0-based horizontal pixel coordinate
+	/// \param y 0-based vertical pixel coordinate
+	/// \return Operation successful? (fails, if the map is full)
+	/// \note The pixel is patched in place in the following frames (see DetectDefects()).
+	bool AddDefect (unsigned x, unsigned y);
+	/// \brief Remove all defective pixels from the defect map
+	void ClearDefects (void);
+	/// \return Number of defective pixels in the map
+	unsigned GetDefectCount (void) const;
+
+	/// \brief Set the color correction matrix, applied by the RGB and YUV conversions
+	/// \param pMatrix Pointer to the matrix (nullptr to disable color correction)
+	/// \note The camera modules set a default matrix for their sensor.
+	/// \note The matrix is applied to the white balanced colors.
+	void SetColorMatrix (const TColorMatrix *pMatrix);
+	/// \return Pointer to the color correction matrix (nullptr if disabled)
+	const TColorMatrix *GetColorMatrix (void) const;
+
+	/// \brief Select the demosaic method of the RGB and YUV conversions
+	/// \param Method Demosaic method (DemosaicBilinear by default)
+	/// \note DemosaicGradient gives sharper edges without zipper artefacts, but takes
+	///	  more CPU time. Compare the frame rates to choose the method per stream.
+	/// \note The gray formats and ConvertScaled() are not affected.
+	void SetDemosaicMethod (TDemosaicMethod Method);
+	/// \return Selected demosaic method
+	TDemosaicMethod GetDemosaicMethod (void) const;
+
 protected:
-	CCameraBuffer *GetFreeBuffer (void);
-	void BufferReady (unsigned nSequence);
+	// for the driver, may be called from interrupt context
+	CCameraBuffer *GetFreeBuffer (void);			// takes a buffer from the free list
+	void PutFreeBuffer (CCameraBuffer *pBuffer);		// returns it unused
+	void BufferReady (CCameraBuffer *pBuffer, unsigned nSequence);
+	void FrameDropped (void);				// no free buffer at frame start
+
+	// called from QueueBuffer() on any core, before the buffer is returned to the
+	// free list, returns true, if UpdateAutoControls() shall apply the metering
+	virtual bool MeterFrame (const CCameraBuffer *pBuffer);
+	// called on core 0 after MeterFrame() (deferred to the next call into the device,
+	// if the buffer has been returned on another core)
+	virtual void UpdateAutoControls (void);
+
+	// moves the white balance factors smoothly towards the given ones
+	void AdjustWhiteBalance (const unsigned pFactor[3]);
+
+private:
+	CCameraBuffer *TakeReadyBuffer (void);
+	void UpdatePendingAutoControls (void);
+	int PopReadyBuffer (void);			// returns buffer index or -1
+
+	unsigned GetBufferIndex (const CCameraBuffer *pBuffer) const;
+	void InitBufferQueue (void);			// all buffers free
 
 private:
 	static const unsigned MaxBuffers = 20;
+	static const unsigned ReadyQueueSize = MaxBuffers + 1;
+
+	enum TAutoControlsState
+	{
+		AutoControlsIdle,
+		AutoControlsMetering,		// MeterFrame() active
+		AutoControlsPending		// UpdateAutoControls() to be called on core 0
+	};
 
 	CCameraBuffer *m_pBuffer[MaxBuffers];
 	unsigned m_nBuffers;
-	volatile int m_nInPtr;
-	volatile int m_nOutPtr;
+
+	volatile int m_nFreeMask;			// bit n set: m_pBuffer[n] is free
+
+	volatile int m_ReadyQueue[ReadyQueueSize];	// indices of the ready buffers (FIFO)
+	volatile int m_nReadyIn;			// written from BufferReady() only
+	volatile int m_nReadyOut;
+
+	CCameraBuffer *m_pNextBuffer;			// held by GetNextBuffer()
+	const CCameraBuffer *volatile m_pLastDequeued;	// for the auto controls
+	volatile int m_nAutoControlsState;		// see TAutoControlsState
+
+	volatile TQueuePolicy m_QueuePolicy;
+
+	// frame delivery counters, see TFrameStatistics
+	volatile int m_nFramesReceived;
+	volatile int m_nFramesDelivered;
+	volatile int m_nFramesDroppedNoBuffer;
+	volatile int m_nFramesDroppedFlush;
+	volatile int m_nFramesOverwritten;
+	volatile unsigned m_nQueueDepthMin;		// written from BufferReady() only
+	volatile unsigned m_nQueueDepthMax;
+	u64 m_nQueueDepthSum;
+	volatile unsigned m_nQueueDepthSamples;
+	volatile int m_LatencyHistogram[TFrameStatistics::LatencyBins];
 
 	TBufferReadyHandler *m_pBufferReadyHandler;
 	void *m_pBufferReadyParam;
+
+#ifdef NO_BUSY_WAIT
+	CSynchronizationEvent m_BufferReadyEvent;	// set from BufferReady()
+#endif
+
+	// maps 12-bit linear values to 8-bit output values
+	static const unsigned ToneCurveSize = 4096;
+	u8 m_ToneCurve[ToneCurveSize];
+	volatile unsigned m_nToneCurveGeneration;	// incremented on each change
+
+	static const unsigned WhiteBalanceSmoothing = 8;	// frames (approximately)
+	volatile unsigned m_WhiteBalance[3];		// R, G, B
+
+	unsigned m_nBlackLevel;				// for 10-bit values
+
+	TLensShading m_LensShading;
+	bool m_bLensShading;				// lens shading correction enabled?
+
+	struct TDefect
+	{
+		u16	x;
+		u16	y;
+	};
+
+	static const unsigned MaxDefects = 1024;
+	TDefect m_Defect[MaxDefects];
+	volatile unsigned m_nDefects;
+
+	TColorMatrix m_ColorMatrix;
+	bool m_bColorMatrix;				// color correction enabled?
+
+	TDemosaicMethod m_DemosaicMethod;
+	friend class CCameraBuffer;
 };
 
 #endif
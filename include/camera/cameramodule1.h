@@ -36,13 +36,13 @@ public:
 
 private:
 	// Called from base class CCSI2CameraDevice
-	bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth);
+	bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth, bool bPacked);
 	TFormatCode GetPhysicalFormat (void) const;
 	TFormatCode GetLogicalFormat (void) const;
 	const TRect GetCropInfo (void) const;
 
 private:
-	bool SetupFormat (unsigned nDepth);
+	bool SetupFormat (unsigned nDepth, bool bPacked);
 	void SetupControls (void);
 
 	bool ReadReg8 (u16 usReg, u8 *pValue);
@@ -85,6 +85,7 @@ private:
 
 	static const TFormatCode s_Formats[2][4];	// 10 and 10P
 	static const TModeInfo s_Modes[];
+	static const TColorMatrix s_ColorMatrix;
 
 	static const TReg s_Regs2592x1944Mode[];
 	static const TReg s_Regs1920x1080Mode[];
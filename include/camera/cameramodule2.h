@@ -10,6 +10,7 @@
 #define _camera_cameramodule2_h
 
 #include <camera/csi2cameradevice.h>
+#include <camera/camerabuffer.h>
 #include <camera/cameracontrol.h>
 #include <camera/camerainfo.h>
 #include <circle/i2cmaster.h>
@@ -47,15 +48,21 @@ public:
 
 private:
 	// Called from base class CCSI2CameraDevice
-	bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth);
+	bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth, bool bPacked);
 	TFormatCode GetPhysicalFormat (void) const;
 	TFormatCode GetLogicalFormat (void) const;
 	const TRect GetCropInfo (void) const;
 
+	// Called from base class CCameraDevice
+	bool MeterFrame (const CCameraBuffer *pBuffer);
+	void UpdateAutoControls (void);
+
 private:
-	bool SetupFormat (unsigned nDepth);
+	bool SetupFormat (unsigned nDepth, bool bPacked);
 	void SetupControls (void);
 
+	void UpdateExposure (bool bAutoExposure, bool bAutoGain);
+
 	bool ReadReg (u16 usReg, unsigned nBytes, u16 *pValue);
 	bool WriteReg (u16 usReg, unsigned nBytes, u16 usValue);
 
@@ -92,8 +99,14 @@ private:
 
 	bool m_bIgnoreErrors;
 
+	// software auto exposure / gain / white balance
+	CCameraBuffer::TStatistics m_Statistics;
+	unsigned m_nAutoSettleSequence;		// first frame, taken with the last settings
+	unsigned m_nMeteredSequence;		// frame, m_Statistics have been taken from
+
 	static const TFormatCode s_Formats[3][4];	// 8, 10 and 10P
 	static const TModeInfo s_Modes[];
+	static const TColorMatrix s_ColorMatrix;
 
 	static const TReg s_Regs3280x2464Mode[];
 	static const TReg s_Regs1920x1080Mode[];
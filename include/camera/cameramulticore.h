@@ -0,0 +1,69 @@
+//
+// cameramulticore.h
+//
+// libcamera - Camera support for Circle
+// Copyright (C) 2022  Rene Stange <rsta2@o2online.de>
+//
+// SPDX-License-Identifier: GPL-2.0
+//
+#ifndef _camera_cameramulticore_h
+#define _camera_cameramulticore_h
+
+#include <circle/sysconfig.h>
+
+#ifdef ARM_ALLOW_MULTI_CORE
+
+#include <circle/multicore.h>
+#include <circle/memory.h>
+#include <circle/types.h>
+
+/// \note If an instance of this class exists and has been initialized, CCameraBuffer
+///	  converts frames in horizontal bands on all CPU cores. The secondary cores are
+///	  owned by this class then and cannot be used for other purposes.
+
+class CCameraMultiCore : public CMultiCoreSupport	/// API: Parallel frame processing on all cores
+{
+public:
+	/// \brief Processes the rows nFirstRow .. nLastRow-1 of a frame
+	typedef void TBandHandler (unsigned nFirstRow, unsigned nLastRow, void *pParam);
+
+public:
+	CCameraMultiCore (CMemorySystem *pMemorySystem);
+	~CCameraMultiCore (void);
+
+	/// \brief Start the secondary cores
+	/// \return Operation successful?
+	bool Initialize (void);
+
+	/// \brief Process the rows 0 .. nRows-1 in one band per core
+	/// \param pHandler Band handler (called concurrently on all cores)
+	/// \param pParam User parameter, which will be handed over to the handler
+	/// \param nRows Total number of rows
+	/// \note Returns, when all bands have been processed.
+	/// \note The bands are processed on the calling core only, when not called on core 0.
+	void Execute (TBandHandler *pHandler, void *pParam, unsigned nRows);
+
+	/// \brief For internal use only
+	void Run (unsigned nCore);
+
+	/// \return Pointer to the initialized instance of this class (or nullptr)
+	static CCameraMultiCore *Get (void);
+
+private:
+	void ProcessBand (unsigned nCore);
+
+private:
+	TBandHandler *m_pHandler;
+	void *m_pParam;
+	unsigned m_nRows;
+
+	volatile int m_nGeneration;	// incremented for each new job
+	volatile int m_nPending;	// number of secondary cores, which are still busy
+	volatile bool m_bTerminate;
+
+	static CCameraMultiCore *s_pThis;
+};
+
+#endif
+
+#endif
@@ -24,7 +24,8 @@ public:
 
 	bool Initialize (void);
 
-	bool SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth = 10);
+	bool SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth = 10,
+			bool bPacked = false);
 
 	TFormatInfo GetFormatInfo (void) const;
 
@@ -32,9 +33,13 @@ protected:
 	bool EnableRX (void);
 	void DisableRX (void);
 
+	// sequence number of the frame, which is currently received
+	unsigned GetCurrentSequence (void) const;
+
 	// implemented by I2C camera driver
 	// returns adjusted width and height
-	virtual bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth) = 0;
+	virtual bool SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth,
+			      bool bPacked) = 0;
 
 	virtual TFormatCode GetPhysicalFormat (void) const = 0;
 	virtual TFormatCode GetLogicalFormat (void) const = 0;
@@ -75,10 +80,11 @@ private:
 	unsigned m_nBytesPerLine;
 	size_t m_nImageSize;
 
-	unsigned m_nSequence;
+	volatile unsigned m_nSequence;
 
 	CCameraBuffer *m_pCurrentBuffer;
 	u8 *m_pDummyBuffer;
+	bool m_bFrameDropped;			// frame start without a free buffer
 };
 
 #endif
@@ -7,47 +7,139 @@
 // SPDX-License-Identifier: GPL-2.0
 //
 #include <camera/camerabuffer.h>
+#include <camera/cameramulticore.h>
 #include <circle/synchronize.h>
 #include <circle/bcm2835.h>
+#include <circle/atomic.h>
+#include <circle/util.h>
 #include <assert.h>
 #include "math.h"
 
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+	#define CAMERA_NEON
+	#include <arm_neon.h>
+#endif
+
+// The frames are converted in tiles of TILE_WIDTH source pixels x TILE_HEIGHT output
+// rows, column tile by column tile, so that the source lines, which are needed for
+// multiple output rows, stay in the L1 data cache, while a tile is processed.
+#if RASPPI == 1
+	#define TILE_WIDTH	256		// ARM1176: 16 KB L1, no L2 for the ARM
+	#define TILE_HEIGHT	16
+#elif RASPPI <= 3
+	#define TILE_WIDTH	512		// Cortex-A7 / -A53: 32 KB L1, 512 KB L2
+	#define TILE_HEIGHT	32
+#else
+	#define TILE_WIDTH	1024		// Cortex-A72 / -A76: 32 KB / 64 KB L1, 1 MB L2
+	#define TILE_HEIGHT	32
+#endif
+
+#define PREFETCH(p)	__builtin_prefetch (p)	// PLD / PRFM PLDL1KEEP
+
 CCameraBuffer::CCameraBuffer (void)
 :	m_nSize (0),
 	m_pBuffer (nullptr),
+	m_bOwnBuffer (false),
+	m_nRefCount (0),
 	m_nWidth (0),
 	m_nHeight (0),
 	m_nBytesPerLine (0),
 	m_Format (CCameraDevice::FormatUnknown),
 	m_ColorFactor {65536, 65536, 65536},
-	m_nSeed (1)
+	m_bPrepared (false),
+	m_nSeed (1),
+	m_pDevice (nullptr),
+	m_bColorMatrix (false),
+	m_nBlackLevel (0),
+	m_pLensShading (nullptr),
+	m_bShading (false),
+	m_DemosaicMethod (CCameraDevice::DemosaicBilinear),
+	m_LUTFactor {0, 0, 0},
+	m_nLUTDepth (0),
+	m_nLUTGeneration (0)
 {
 }
 
 CCameraBuffer::~CCameraBuffer (void)
 {
-	delete [] m_pBuffer;
+	if (m_bOwnBuffer)
+	{
+		delete [] m_pBuffer;
+	}
+
 	m_pBuffer = nullptr;
 }
 
-bool CCameraBuffer::Setup (size_t nSize)
+bool CCameraBuffer::Setup (size_t nSize, const CCameraDevice *pDevice)
 {
-	delete [] m_pBuffer;
+	m_pDevice = pDevice;
+
+	if (m_bOwnBuffer)
+	{
+		delete [] m_pBuffer;
+	}
 
 	assert (nSize);
 	m_nSize = nSize;
 
 	m_pBuffer = new u8[nSize];
+	m_bOwnBuffer = true;
 
 	return !!m_pBuffer;
 }
 
+// The region is written by the Unicam DMA and is cleaned and invalidated as a whole
+// before each frame, so that it must not share cache lines with other data.
+// BUS_ADDRESS() maps only the first GB of the ARM memory for the DMA, and silently
+// aliases higher addresses, which is therefore checked here too.
+bool CCameraBuffer::Setup (void *pMemory, size_t nSize, const CCameraDevice *pDevice)
+{
+	m_pDevice = pDevice;
+
+	if (m_bOwnBuffer)
+	{
+		delete [] m_pBuffer;
+	}
+
+	m_pBuffer = nullptr;
+	m_bOwnBuffer = false;
+
+	uintptr nAddress = reinterpret_cast<uintptr> (pMemory);
+	if (   !nAddress
+	    || !nSize
+	    || (nAddress & (DATA_CACHE_LINE_LENGTH_MAX-1))
+	    || (nSize & (DATA_CACHE_LINE_LENGTH_MAX-1)))
+	{
+		return false;
+	}
+
+	const uintptr nDMAWindow = 0x40000000;		// 1 GB
+	if (   nSize > nDMAWindow
+	    || nAddress > nDMAWindow - nSize
+	    || (BUS_ADDRESS (nAddress) & (nDMAWindow-1)) != nAddress)
+	{
+		return false;
+	}
+
+	m_nSize = nSize;
+	m_pBuffer = static_cast<u8 *> (pMemory);
+
+	return true;
+}
+
 void *CCameraBuffer::GetPtr (void) const
 {
 	assert (m_pBuffer);
 	return m_pBuffer;
 }
 
+void CCameraBuffer::AddReference (void)
+{
+	int nRefCount = AtomicIncrement (&m_nRefCount);
+	assert (nRefCount > 1);			// dequeued before?
+	(void) nRefCount;
+}
+
 uintptr CCameraBuffer::GetDMAAddress (void) const
 {
 	assert (m_pBuffer);
@@ -82,134 +174,518 @@ void CCameraBuffer::SetFormat (unsigned nWidth, unsigned nHeight, unsigned nByte
 	m_nBytesPerLine = nBytesPerLine;
 	m_Format = Format;
 
-	m_ColorFactor[0] = 65536;
-	m_ColorFactor[1] = 65536;
-	m_ColorFactor[2] = 65536;
+	m_bPrepared = false;
+
+	// the white balance factors of the device apply to each new frame
+	for (unsigned i = 0; i < 3; i++)
+	{
+		m_ColorFactor[i] = m_pDevice ? m_pDevice->m_WhiteBalance[i] : 65536;
+	}
 }
 
-// This method reads the color values from a captured image in Bayer format
-// (normally 16 bits occupied per value, 10 bits valid) and  returns the
-// color components.
-CCameraBuffer::TPixel CCameraBuffer::GetPixel (unsigned x, unsigned y)
+// Four 10-bit Bayer values, packed as received (Sxxxx10P formats): The bytes in
+// High[] are the upper 8 bits of the values, Low contains the lower 2 bits of
+// each of them, starting with the first value at bit 0.
+struct TRAW10Group
+{
+	u8	High[4];
+	u8	Low;
+};
+
+// Return the Bayer value at horizontal position x from a pixel line.
+static inline unsigned Fetch (const u8 *pLine, unsigned x)
+{
+	return pLine[x];
+}
+
+static inline unsigned Fetch (const u16 *pLine, unsigned x)
+{
+	return pLine[x];
+}
+
+static inline unsigned Fetch (const TRAW10Group *pLine, unsigned x)
+{
+	const TRAW10Group &Group = pLine[x >> 2];
+
+	return Group.High[x & 3] << 2 | (Group.Low >> ((x & 3) << 1) & 3);
+}
+
+// Write the Bayer value at horizontal position x to a pixel line.
+static inline void Store (u8 *pLine, unsigned x, unsigned nValue)
+{
+	pLine[x] = nValue;
+}
+
+static inline void Store (u16 *pLine, unsigned x, unsigned nValue)
+{
+	pLine[x] = nValue;
+}
+
+static inline void Store (TRAW10Group *pLine, unsigned x, unsigned nValue)
+{
+	TRAW10Group &Group = pLine[x >> 2];
+	const unsigned nShift = (x & 3) << 1;
+
+	Group.High[x & 3] = nValue >> 2;
+	Group.Low = (Group.Low & ~(3 << nShift)) | (nValue & 3) << nShift;
+}
+
+// Unpacks nCount 10-bit values, starting at horizontal position x, into 16 bits each.
+static void UnpackRAW10 (const TRAW10Group *pLine, unsigned x, unsigned nCount, u16 *pOut)
 {
-	// We ignore the border lines/cols to make the processing more simple.
-	if (   x == 0 || x >= m_nWidth-1
-	    || y == 0 || y >= m_nHeight-1)
+	for (; nCount && (x & 3); nCount--)
+	{
+		*pOut++ = Fetch (pLine, x++);
+	}
+
+	const TRAW10Group *pGroup = pLine + (x >> 2);
+	for (; nCount >= 4; nCount -= 4, x += 4, pGroup++, pOut += 4)
 	{
-		return {0, 0, 0};
+		const unsigned nLow = pGroup->Low;
+
+		pOut[0] = pGroup->High[0] << 2 | (nLow      & 3);
+		pOut[1] = pGroup->High[1] << 2 | (nLow >> 2 & 3);
+		pOut[2] = pGroup->High[2] << 2 | (nLow >> 4 & 3);
+		pOut[3] = pGroup->High[3] << 2 | (nLow >> 6);
 	}
 
-	typedef u16 TImage[][m_nBytesPerLine / sizeof (u16)];
-	TImage *p = reinterpret_cast<TImage *> (m_pBuffer);
+	while (nCount--)
+	{
+		*pOut++ = Fetch (pLine, x++);
+	}
+}
 
+// Interpolates the missing color components of the pixel at position x / y, which
+// has a color filter of the given color. T is the type of a Bayer value (u8 or u16)
+// or TRAW10Group for packed formats. xl / xr are the columns left and right of the
+// pixel and ya / yb the lines above and below it (mirrored at the frame borders).
+template <typename T>
+static CCameraBuffer::TPixel InterpolatePixel (const u8 *pBuffer, unsigned nBytesPerLine,
+					       unsigned x, unsigned y,
+					       unsigned xl, unsigned xr, unsigned ya, unsigned yb,
+					       CCameraDevice::TColorComponent Color)
+{
 	// L(x, y) is the color value at position x / y
-	#define L(x, y) ((*(p))[(y)][(x)])
+	#define L(x, y) Fetch (reinterpret_cast<const T *> (pBuffer + (y) * nBytesPerLine), (x))
 
 	u16 CL = L (x, y);
 	u16 CR, CG, CB;
 
 	// For interpolating the missing color values see:
 	// http://siliconimaging.com/RGB%20Bayer.htm
-	switch (CCameraDevice::GetFormatColor (m_Format, x, y))
+	switch (Color)
 	{
 	case CCameraDevice::R:
 		CR = CL;
-		CG = (L (x, y-1) + L (x, y+1) + L (x-1, y) + L (x+1, y)) / 4;
-		CB = (L (x-1, y-1) + L (x+1, y-1) + L (x-1, y+1) + L (x+1, y+1)) / 4;
+		CG = (L (x, ya) + L (x, yb) + L (xl, y) + L (xr, y)) / 4;
+		CB = (L (xl, ya) + L (xr, ya) + L (xl, yb) + L (xr, yb)) / 4;
 		break;
 
 	case CCameraDevice::GR:
-		CR = (L (x-1, y) + L (x+1, y)) / 2;
+		CR = (L (xl, y) + L (xr, y)) / 2;
 		CG = CL;
-		CB = (L (x, y-1) + L (x, y+1)) / 2;
+		CB = (L (x, ya) + L (x, yb)) / 2;
 		break;
 
 	case CCameraDevice::GB:
-		CR = (L (x, y-1) + L (x, y+1)) / 2;
+		CR = (L (x, ya) + L (x, yb)) / 2;
 		CG = CL;
-		CB = (L (x-1, y) + L (x+1, y)) / 2;
+		CB = (L (xl, y) + L (xr, y)) / 2;
 		break;
 
-	case CCameraDevice::B:
-		CR = (L (x-1, y-1) + L (x+1, y-1) + L (x-1, y+1) + L (x+1, y+1)) / 4;
-		CG = (L (x, y-1) + L (x, y+1) + L (x-1, y) + L (x+1, y)) / 4;
+	default:
+		CR = (L (xl, ya) + L (xr, ya) + L (xl, yb) + L (xr, yb)) / 4;
+		CG = (L (x, ya) + L (x, yb) + L (xl, y) + L (xr, y)) / 4;
 		CB = CL;
 		break;
 	}
 
+	#undef L
+
 	return {CR, CG, CB};
 }
 
-u32 CCameraBuffer::GetPixelRGB888 (unsigned x, unsigned y)
+static inline u16 Clip (int nValue, int nMax)
+{
+	return nValue < 0 ? 0 : (nValue > nMax ? nMax : nValue);
+}
+
+// Interpolation of nCount pixels of a line with the 5x5 gradient-corrected linear
+// filters from: H. S. Malvar, L. He, R. Cutler: High-quality linear interpolation for
+// demosaicing of Bayer-patterned color images. The coefficients are scaled by 16, so
+// that they are integers. pLine[0..4] point to the first pixel in the lines y-2 to
+// y+2, which must be valid from index -2 to nCount+1. "Own" is the color of the red
+// or blue filters in this row, "Other" the opposite one.
+static void DemosaicGradientRow (const u16 *const pLine[5], unsigned nCount, bool bGreenFirst,
+				 int nMax, u16 *pOwn, u16 *pGreen, u16 *pOther)
 {
-	const TPixel Pixel = GetPixel (x, y);
+	const u16 *A2 = pLine[0];		// two lines above
+	const u16 *A1 = pLine[1];
+	const u16 *C  = pLine[2];		// center line
+	const u16 *B1 = pLine[3];
+	const u16 *B2 = pLine[4];		// two lines below
 
-	unsigned nShift = CCameraDevice::GetFormatDepth (m_Format) - 8 + 16;
-	u16 CR = Pixel.R * m_ColorFactor[0] >> nShift;
-	u16 CG = Pixel.G * m_ColorFactor[1] >> nShift;
-	u16 CB = Pixel.B * m_ColorFactor[2] >> nShift;
+	bool bGreen = bGreenFirst;
+	for (int i = 0; i < (int) nCount; i++, bGreen = !bGreen)
+	{
+		const int c = C[i];
 
-	if (CR > 255) CR = 255;
-	if (CG > 255) CG = 255;
-	if (CB > 255) CB = 255;
+		if (bGreen)
+		{
+			const int nBase = 10*c - 2*(A1[i-1] + A1[i+1] + B1[i-1] + B1[i+1]);
 
-	return (CB << 16) | (CG << 8) | CR;
+			pOwn[i]   = Clip ((nBase + 8*(C[i-1] + C[i+1]) - 2*(C[i-2] + C[i+2])
+					   + A2[i] + B2[i] + 8) >> 4, nMax);
+			pGreen[i] = c;
+			pOther[i] = Clip ((nBase + 8*(A1[i] + B1[i]) - 2*(A2[i] + B2[i])
+					   + C[i-2] + C[i+2] + 8) >> 4, nMax);
+		}
+		else
+		{
+			const int nAxial = A2[i] + B2[i] + C[i-2] + C[i+2];
+
+			pOwn[i]   = c;
+			pGreen[i] = Clip ((8*c + 4*(A1[i] + B1[i] + C[i-1] + C[i+1])
+					   - 2*nAxial + 8) >> 4, nMax);
+			pOther[i] = Clip ((12*c + 4*(A1[i-1] + A1[i+1] + B1[i-1] + B1[i+1])
+					   - 3*nAxial + 8) >> 4, nMax);
+		}
+	}
 }
 
-void CCameraBuffer::ConvertToRGB888 (void *pOutBuffer)
+// Copies nCount Bayer values of a line, starting at horizontal position x, into pOut.
+template <typename T>
+static inline void FetchRange (const T *pLine, unsigned x, unsigned nCount, u16 *pOut)
 {
-	assert (m_nWidth);
-	assert (m_nHeight);
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		pOut[i] = Fetch (pLine, x + i);
+	}
+}
+
+static inline void FetchRange (const TRAW10Group *pLine, unsigned x, unsigned nCount, u16 *pOut)
+{
+	UnpackRAW10 (pLine, x, nCount, pOut);
+}
+
+// Copies the Bayer values of a line from horizontal position x-2 to x+nCount+1 into
+// pOut. The columns outside of the frame are mirrored, which keeps the Bayer phase.
+template <typename T>
+static void GatherLine (const T *pLine, unsigned nWidth, unsigned x, unsigned nCount,
+			u16 *pOut)
+{
+	int i = (int) x - 2;
+	const int nEnd = (int) (x + nCount) + 2;
+	const int nLast = nEnd < (int) nWidth ? nEnd : (int) nWidth;
+
+	for (; i < 0; i++)
+	{
+		*pOut++ = Fetch (pLine, -i);
+	}
+
+	FetchRange (pLine, i, nLast - i, pOut);
+	pOut += nLast - i;
+
+	for (i = nLast; i < nEnd; i++)
+	{
+		*pOut++ = Fetch (pLine, 2 * (nWidth - 1) - i);
+	}
+}
+
+// Returns the position nPos in a line or column of nSize values, which is mirrored
+// at the borders. This keeps the Bayer phase.
+static inline unsigned Mirror (int nPos, unsigned nSize)
+{
+	if (nPos < 0)
+	{
+		return -nPos;
+	}
+
+	if (nPos >= (int) nSize)
+	{
+		return 2 * (nSize - 1) - nPos;
+	}
+
+	return nPos;
+}
+
+// Copies the 5x5 Bayer values around the pixel at position x / y into Window. T is
+// the type of a Bayer value (u8 or u16) or TRAW10Group for packed formats.
+template <typename T>
+static void GatherWindow (const u8 *pBuffer, unsigned nBytesPerLine, unsigned nWidth,
+			  unsigned nHeight, unsigned x, unsigned y, u16 Window[5][5])
+{
+	unsigned Column[5];
+	for (unsigned i = 0; i < 5; i++)
+	{
+		Column[i] = Mirror ((int) (x + i) - 2, nWidth);
+	}
+
+	for (unsigned j = 0; j < 5; j++)
+	{
+		const T *pLine = reinterpret_cast<const T *> (
+			pBuffer + Mirror ((int) (y + j) - 2, nHeight) * nBytesPerLine);
+
+		for (unsigned i = 0; i < 5; i++)
+		{
+			Window[j][i] = Fetch (pLine, Column[i]);
+		}
+	}
+}
 
-	u8 *p = static_cast<u8 *> (pOutBuffer);
-	assert (p);
+// This method reads the color values from a captured image in Bayer format
+// (8 bits per value, or normally 16 bits occupied per value, 10 bits valid,
+// or 10 bits packed) and returns the color components.
+CCameraBuffer::TPixel CCameraBuffer::GetPixel (unsigned x, unsigned y)
+{
+	assert (x < m_nWidth && y < m_nHeight);
+	assert (m_bPrepared);
 
-	for (unsigned y = 0; y < m_nHeight; y++)
+	if (   m_pDevice
+	    && m_pDevice->GetDemosaicMethod () == CCameraDevice::DemosaicGradient)
 	{
-		for (unsigned x = 0; x < m_nWidth; x++)
+		assert (m_nWidth >= 3 && m_nHeight >= 3);
+
+		u16 Window[5][5];
+		if (CCameraDevice::IsFormatPacked (m_Format))
+		{
+			GatherWindow<TRAW10Group> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+						   x, y, Window);
+		}
+		else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
 		{
-			const u32 nPixel = GetPixelRGB888 (x, y);
+			GatherWindow<u8> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					  x, y, Window);
+		}
+		else
+		{
+			GatherWindow<u16> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					   x, y, Window);
+		}
+
+		const u16 *const pLine[5] = {Window[0] + 2, Window[1] + 2, Window[2] + 2,
+					     Window[3] + 2, Window[4] + 2};
 
-			p[0] = nPixel & 0xFF;
-			p[1] = (nPixel >> 8) & 0xFF;
-			p[2] = (nPixel >> 16) & 0xFF;
+		CCameraDevice::TColorComponent Color = CCameraDevice::GetFormatColor (m_Format, x, y);
+		bool bGreen = Color == CCameraDevice::GR || Color == CCameraDevice::GB;
+		bool bRedRow = Color == CCameraDevice::R || Color == CCameraDevice::GR;
+		const int nMax = (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1;
 
-			p += 3;
+		u16 nOwn, nGreen, nOther;
+		DemosaicGradientRow (pLine, 1, bGreen, nMax, &nOwn, &nGreen, &nOther);
+
+		if (bRedRow)
+		{
+			return {nOwn, nGreen, nOther};
 		}
+
+		return {nOther, nGreen, nOwn};
+	}
+
+	// The neighbours are mirrored at the border lines/cols, which keeps the Bayer phase.
+	const unsigned xl = x > 0 ? x - 1 : x + 1;
+	const unsigned xr = x < m_nWidth - 1 ? x + 1 : x - 1;
+	const unsigned ya = y > 0 ? y - 1 : y + 1;
+	const unsigned yb = y < m_nHeight - 1 ? y + 1 : y - 1;
+
+	CCameraDevice::TColorComponent Color = CCameraDevice::GetFormatColor (m_Format, x, y);
+
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		return InterpolatePixel<TRAW10Group> (m_pBuffer, m_nBytesPerLine, x, y,
+						      xl, xr, ya, yb, Color);
 	}
+
+	if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+	{
+		return InterpolatePixel<u8> (m_pBuffer, m_nBytesPerLine, x, y, xl, xr, ya, yb, Color);
+	}
+
+	return InterpolatePixel<u16> (m_pBuffer, m_nBytesPerLine, x, y, xl, xr, ya, yb, Color);
 }
 
-u16 CCameraBuffer::GetPixelRGB565 (unsigned x, unsigned y)
+// Applies the color correction matrix M (10 fractional bits) to one pixel
+// and clips the results to the range 0..nMax.
+static inline void CorrectColor (const s16 M[3][3], int nMax, u16 *pR, u16 *pG, u16 *pB)
+{
+	int R = *pR, G = *pG, B = *pB;
+	int Result[3];
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		int nValue = (M[i][0] * R + M[i][1] * G + M[i][2] * B + 512) >> 10;
+
+		Result[i] = nValue < 0 ? 0 : (nValue > nMax ? nMax : nValue);
+	}
+
+	*pR = Result[0];
+	*pG = Result[1];
+	*pB = Result[2];
+}
+
+// Applies the same corrections to a single pixel as the conversions to a span.
+CCameraBuffer::TPixel CCameraBuffer::GetCorrectedPixel (unsigned x, unsigned y)
+{
+	TPixel Pixel = GetPixel (x, y);
+
+	if (m_bShading)
+	{
+		u16 *const pColor[3] = {&Pixel.R, &Pixel.G, &Pixel.B};
+
+		ShadeColors (x, y, 1, 0, pColor);
+	}
+
+	if (m_bColorMatrix)
+	{
+		CorrectColor (m_ColorMatrix, (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1,
+			      &Pixel.R, &Pixel.G, &Pixel.B);
+	}
+
+	return Pixel;
+}
+
+u32 CCameraBuffer::GetPixelRGB888 (unsigned x, unsigned y)
+{
+	const TPixel Pixel = GetCorrectedPixel (x, y);
+
+	u32 CR = m_LUT[0][Pixel.R];
+	u32 CG = m_LUT[1][Pixel.G];
+	u32 CB = m_LUT[2][Pixel.B];
+
+	return (CB << 16) | (CG << 8) | CR;
+}
+
+void CCameraBuffer::ConvertToRGB888 (void *pOutBuffer, bool bHalfResolution)
 {
-	const TPixel Pixel = GetPixel (x, y);
+	assert (pOutBuffer);
+
+	if (bHalfResolution)
+	{
+		ConvertScaled (pOutBuffer, m_nWidth / 2 * 3, PixelFormatRGB888, 2);
+	}
+	else
+	{
+		Convert (pOutBuffer, m_nWidth * 3, PixelFormatRGB888);
+	}
+}
 
-	unsigned nShift = CCameraDevice::GetFormatDepth (m_Format) - 5 + 16;
-	u16 CR = Pixel.R * m_ColorFactor[0] >> nShift;
-	u16 CG = Pixel.G * m_ColorFactor[1] >> (nShift - 1);
-	u16 CB = Pixel.B * m_ColorFactor[2] >> nShift;
+u16 CCameraBuffer::GetPixelRGB565 (unsigned x, unsigned y)
+{
+	const TPixel Pixel = GetCorrectedPixel (x, y);
 
-	if (CR > 31) CR = 31;
-	if (CG > 63) CG = 63;
-	if (CB > 31) CB = 31;
+	u16 CR = m_LUT[0][Pixel.R] >> 3;
+	u16 CG = m_LUT[1][Pixel.G] >> 2;
+	u16 CB = m_LUT[2][Pixel.B] >> 3;
 
 	return (CR << 11) | (CG << 5) | CB;
 }
 
-void CCameraBuffer::ConvertToRGB565 (void *pOutBuffer)
+void CCameraBuffer::ConvertToRGB565 (void *pOutBuffer, bool bHalfResolution)
 {
-	assert (m_nWidth);
-	assert (m_nHeight);
+	assert (pOutBuffer);
+
+	if (bHalfResolution)
+	{
+		ConvertScaled (pOutBuffer, m_nWidth / 2 * 2, PixelFormatRGB565, 2);
+	}
+	else
+	{
+		Convert (pOutBuffer, m_nWidth * 2, PixelFormatRGB565);
+	}
+}
+
+void CCameraBuffer::ConvertToGray8 (void *pOutBuffer, unsigned nPitch, bool bHalfResolution,
+				    const CCameraDevice::TRect *pSourceRect)
+{
+	assert (pOutBuffer);
 
-	u16 *p = static_cast<u16 *> (pOutBuffer);
-	assert (p);
+	unsigned nWidth = pSourceRect ? pSourceRect->Width : m_nWidth;
 
-	for (unsigned y = 0; y < m_nHeight; y++)
+	if (bHalfResolution)
 	{
-		for (unsigned x = 0; x < m_nWidth; x++)
-		{
-			*p++ = GetPixelRGB565 (x, y);
-		}
+		ConvertScaled (pOutBuffer, nPitch ? nPitch : nWidth / 2, PixelFormatGray8, 2,
+			       pSourceRect);
+	}
+	else
+	{
+		Convert (pOutBuffer, nPitch ? nPitch : nWidth, PixelFormatGray8, pSourceRect);
+	}
+}
+
+void CCameraBuffer::ConvertToGray16 (void *pOutBuffer, unsigned nPitch, bool bHalfResolution,
+				     const CCameraDevice::TRect *pSourceRect)
+{
+	assert (pOutBuffer);
+
+	unsigned nWidth = pSourceRect ? pSourceRect->Width : m_nWidth;
+
+	if (bHalfResolution)
+	{
+		ConvertScaled (pOutBuffer, nPitch ? nPitch : nWidth / 2 * 2, PixelFormatGray16, 2,
+			       pSourceRect);
+	}
+	else
+	{
+		Convert (pOutBuffer, nPitch ? nPitch : nWidth * 2, PixelFormatGray16, pSourceRect);
+	}
+}
+
+void CCameraBuffer::Convert (void *pOutBuffer, unsigned nPitch, TPixelFormat Format,
+			     const CCameraDevice::TRect *pSourceRect)
+{
+	assert (pOutBuffer);
+	assert (Format < PixelFormatUnknown);
+
+	TConvertJob Job {this, Format, static_cast<u8 *> (pOutBuffer), nPitch,
+			 {0, 0, m_nWidth, m_nHeight}, 0};
+
+	if (pSourceRect)
+	{
+		assert (pSourceRect->Left + pSourceRect->Width <= m_nWidth);
+		assert (pSourceRect->Top + pSourceRect->Height <= m_nHeight);
+
+		Job.Rect = *pSourceRect;
+	}
+
+	// the chroma is calculated from whole Bayer quads
+	assert (   Format < PixelFormatYUYV
+		|| !((Job.Rect.Left | Job.Rect.Top | Job.Rect.Width | Job.Rect.Height) & 1));
+
+	ConvertFrame (&Job);
+}
+
+void CCameraBuffer::ConvertScaled (void *pOutBuffer, unsigned nPitch, TPixelFormat Format,
+				   unsigned nScale, const CCameraDevice::TRect *pSourceRect)
+{
+	assert (pOutBuffer);
+	assert (Format < PixelFormatYUYV);
+
+	unsigned nScaleShift;
+	switch (nScale)
+	{
+	case 2:	nScaleShift = 1;	break;
+	case 4:	nScaleShift = 2;	break;
+	case 8:	nScaleShift = 3;	break;
+
+	default:
+		assert (0);
+		return;
+	}
+
+	TConvertJob Job {this, Format, static_cast<u8 *> (pOutBuffer), nPitch,
+			 {0, 0, m_nWidth, m_nHeight}, nScaleShift};
+
+	if (pSourceRect)
+	{
+		assert (!(pSourceRect->Left & 1));
+		assert (!(pSourceRect->Top & 1));
+		assert (pSourceRect->Left + pSourceRect->Width <= m_nWidth);
+		assert (pSourceRect->Top + pSourceRect->Height <= m_nHeight);
+
+		Job.Rect = *pSourceRect;
 	}
+
+	ConvertFrame (&Job);
 }
 
 // Based on the file main.cpp from the archive iwp.zip, download here:
@@ -257,6 +733,1930 @@ void CCameraBuffer::WhiteBalance (unsigned N, unsigned M)
 	m_ColorFactor[0] = 65536 * fSum / Result[0];
 	m_ColorFactor[1] = 65536 * fSum / Result[1];
 	m_ColorFactor[2] = 65536 * fSum / Result[2];
+
+	UpdateColorTables ();
+}
+
+// Accumulates the statistics of every nStride-th quad of the quad row, which
+// starts at line y, from quad column nFirst up to (excluding) nLast into pZone
+// and into the histograms and saturation counters of pStats.
+template <typename T>
+static void StatRow (const u8 *pBuffer, unsigned nBytesPerLine, unsigned y,
+		     const unsigned nPosX[4], const unsigned nPosY[4],
+		     unsigned nFirst, unsigned nLast, unsigned nStride,
+		     unsigned nMax, unsigned nBinShift,
+		     CCameraBuffer::TStatistics *pStats, CCameraBuffer::TStatistics::TZone *pZone)
+{
+	const T *pLine[2] =
+	{
+		reinterpret_cast<const T *> (pBuffer + y * nBytesPerLine),
+		reinterpret_cast<const T *> (pBuffer + (y + 1) * nBytesPerLine)
+	};
+
+	u32 *pHistR = pStats->Histogram[0];
+	u32 *pHistG = pStats->Histogram[1];
+	u32 *pHistB = pStats->Histogram[2];
+	u32 *pHistY = pStats->Histogram[3];
+
+	unsigned nSumR = 0, nSumG = 0, nSumB = 0, nSumY = 0;
+	unsigned nCount = 0, nSaturated = 0;
+
+	for (unsigned qx = 2 * nFirst; qx < 2 * nLast; qx += 2 * nStride)
+	{
+		unsigned R = Fetch (pLine[nPosY[CCameraDevice::R]], qx + nPosX[CCameraDevice::R]);
+		unsigned G = (  Fetch (pLine[nPosY[CCameraDevice::GR]], qx + nPosX[CCameraDevice::GR])
+			      + Fetch (pLine[nPosY[CCameraDevice::GB]], qx + nPosX[CCameraDevice::GB])
+			      + 1) >> 1;
+		unsigned B = Fetch (pLine[nPosY[CCameraDevice::B]], qx + nPosX[CCameraDevice::B]);
+		unsigned Y = (77 * R + 150 * G + 29 * B + 128) >> 8;
+
+		nSumR += R;
+		nSumG += G;
+		nSumB += B;
+		nSumY += Y;
+
+		pHistR[R >> nBinShift]++;
+		pHistG[G >> nBinShift]++;
+		pHistB[B >> nBinShift]++;
+		pHistY[Y >> nBinShift]++;
+
+		bool bSaturated = false;
+		if (R >= nMax) { pStats->Saturated[0]++; bSaturated = true; }
+		if (G >= nMax) { pStats->Saturated[1]++; bSaturated = true; }
+		if (B >= nMax) { pStats->Saturated[2]++; bSaturated = true; }
+		nSaturated += bSaturated;
+
+		nCount++;
+	}
+
+	pZone->Sum[0] += nSumR;
+	pZone->Sum[1] += nSumG;
+	pZone->Sum[2] += nSumB;
+	pZone->Sum[3] += nSumY;
+	pZone->Count += nCount;
+	pZone->Saturated += nSaturated;
+}
+
+void CCameraBuffer::GetStatistics (TStatistics *pStats) const
+{
+	assert (pStats);
+	assert (m_pBuffer);
+
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+	const unsigned nQuadsX = m_nWidth / 2;
+	const unsigned nQuadsY = m_nHeight / 2;
+
+	const unsigned nBins = pStats->Bins;
+	const unsigned nStride = pStats->Stride;
+	const unsigned nZonesX = pStats->ZonesX;
+	const unsigned nZonesY = pStats->ZonesY;
+	assert (1 <= nBins && nBins <= TStatistics::MaxBins && nBins <= 1U << nDepth);
+	assert (!(nBins & (nBins - 1)));
+	assert (nStride >= 1);
+	assert (1 <= nZonesX && nZonesX <= TStatistics::MaxZonesX && nZonesX <= nQuadsX);
+	assert (1 <= nZonesY && nZonesY <= TStatistics::MaxZonesY && nZonesY <= nQuadsY);
+
+	unsigned nBinShift = nDepth;
+	while (1U << (nDepth - nBinShift) < nBins)
+	{
+		nBinShift--;
+	}
+
+	pStats->Depth = nDepth;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		pStats->Saturated[i] = 0;
+	}
+	for (unsigned i = 0; i < 4; i++)
+	{
+		memset (pStats->Histogram[i], 0, nBins * sizeof (u32));
+	}
+	for (unsigned i = 0; i < nZonesY; i++)
+	{
+		memset (pStats->Zone[i], 0, nZonesX * sizeof (TStatistics::TZone));
+	}
+
+	unsigned nPosX[4], nPosY[4];
+	GetQuadPositions (nPosX, nPosY);
+
+	const unsigned nMax = (1 << nDepth) - 1;
+	const bool bPacked = CCameraDevice::IsFormatPacked (m_Format);
+
+	// the distance of the sampled quads in a line in bytes for the prefetch hints
+	unsigned nPrefetchStep = 2 * nStride * m_nBytesPerLine / m_nWidth;
+	if (nPrefetchStep < DATA_CACHE_LINE_LENGTH_MIN)
+	{
+		nPrefetchStep = DATA_CACHE_LINE_LENGTH_MIN;
+	}
+
+	// only quad rows and columns, which are a multiple of nStride, are sampled
+	for (unsigned qy = 0; qy < nQuadsY; qy += nStride)
+	{
+		TStatistics::TZone *pZone = pStats->Zone[qy * nZonesY / nQuadsY];
+
+		PrefetchLines (0, 2 * (qy + nStride), m_nWidth, 2, nPrefetchStep);
+
+		for (unsigned zx = 0; zx < nZonesX; zx++, pZone++)
+		{
+			unsigned nFirst = (zx * nQuadsX / nZonesX + nStride - 1) / nStride * nStride;
+			unsigned nLast = (zx + 1) * nQuadsX / nZonesX;
+
+			if (bPacked)
+			{
+				StatRow<TRAW10Group> (m_pBuffer, m_nBytesPerLine, 2 * qy, nPosX, nPosY,
+						      nFirst, nLast, nStride, nMax, nBinShift,
+						      pStats, pZone);
+			}
+			else if (nDepth == 8)
+			{
+				StatRow<u8> (m_pBuffer, m_nBytesPerLine, 2 * qy, nPosX, nPosY,
+					     nFirst, nLast, nStride, nMax, nBinShift, pStats, pZone);
+			}
+			else
+			{
+				StatRow<u16> (m_pBuffer, m_nBytesPerLine, 2 * qy, nPosX, nPosY,
+					      nFirst, nLast, nStride, nMax, nBinShift, pStats, pZone);
+			}
+		}
+	}
+
+	pStats->Count = 0;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		pStats->Sum[i] = 0;
+	}
+
+	for (unsigned zy = 0; zy < nZonesY; zy++)
+	{
+		for (unsigned zx = 0; zx < nZonesX; zx++)
+		{
+			const TStatistics::TZone &Zone = pStats->Zone[zy][zx];
+
+			pStats->Count += Zone.Count;
+			for (unsigned i = 0; i < 4; i++)
+			{
+				pStats->Sum[i] += Zone.Sum[i];
+			}
+		}
+	}
+}
+
+bool CCameraBuffer::EstimateWhiteBalance (const TStatistics &Stats, unsigned nBlackLevel,
+					  unsigned pFactor[3])
+{
+	assert (pFactor);
+
+	const unsigned nMax = (1 << Stats.Depth) - 1;
+	assert (nBlackLevel < nMax);
+
+	// zones with a mean luminance below 1/32 of the range are ignored
+	const unsigned nDark = nBlackLevel + (nMax - nBlackLevel) / 32;
+
+	u64 GreyWorld[3] = {0, 0, 0};			// sums of all valid zones
+	u64 WhitePatch[3] = {0, 0, 0};			// sums of the brightest valid zone
+	const TStatistics::TZone *pWhitePatch = nullptr;
+
+	for (unsigned zy = 0; zy < Stats.ZonesY; zy++)
+	{
+		for (unsigned zx = 0; zx < Stats.ZonesX; zx++)
+		{
+			const TStatistics::TZone &Zone = Stats.Zone[zy][zx];
+
+			if (   !Zone.Count
+			    || Zone.Saturated
+			    || Zone.Sum[3] < (u64) Zone.Count * nDark)
+			{
+				continue;
+			}
+
+			// compare the mean luminance of the zones
+			bool bBrightest =    !pWhitePatch
+					  ||   (u64) Zone.Sum[3] * pWhitePatch->Count
+					     > (u64) pWhitePatch->Sum[3] * Zone.Count;
+			if (bBrightest)
+			{
+				pWhitePatch = &Zone;
+			}
+
+			for (unsigned i = 0; i < 3; i++)
+			{
+				u64 nBlack = (u64) Zone.Count * nBlackLevel;
+				u64 nSum = Zone.Sum[i] > nBlack ? Zone.Sum[i] - nBlack : 0;
+
+				GreyWorld[i] += nSum;
+				if (bBrightest)
+				{
+					WhitePatch[i] = nSum;
+				}
+			}
+		}
+	}
+
+	if (   !pWhitePatch
+	    || !GreyWorld[0] || !GreyWorld[2]
+	    || !WhitePatch[0] || !WhitePatch[2])
+	{
+		return false;
+	}
+
+	for (unsigned i = 0; i < 3; i += 2)
+	{
+		float fFactor =   (float) GreyWorld[1] / GreyWorld[i]
+				+ (float) WhitePatch[1] / WhitePatch[i];
+		fFactor *= 65536 / 2;
+
+		// limit the factors to 1/4 .. 4
+		pFactor[i] =   fFactor < 65536 / 4 ? 65536 / 4
+			     : (fFactor > 65536 * 4 ? 65536 * 4 : (unsigned) fFactor);
+	}
+
+	pFactor[1] = 65536;
+
+	return true;
+}
+
+// Offsets of the nearest neighbours with the same color
+static const int NeighboursGreen[4][2] = {{-1, -1}, {1, -1}, {-1, 1}, {1, 1}};
+static const int NeighboursRedBlue[4][2] = {{0, -2}, {-2, 0}, {2, 0}, {0, 2}};
+
+// Adds the pixels, which differ from all of their neighbours with the same color by
+// more than nThreshold, to the defect map of pDevice. The border pixels are skipped.
+template <typename T>
+static void FindDefectsInFrame (const u8 *pBuffer, unsigned nBytesPerLine,
+				unsigned nWidth, unsigned nHeight,
+				CCameraDevice::TFormatCode Format, unsigned nThreshold,
+				CCameraDevice *pDevice)
+{
+	for (unsigned y = 2; y < nHeight - 2; y++)
+	{
+		const T *pLine = reinterpret_cast<const T *> (pBuffer + y * nBytesPerLine);
+
+		for (unsigned x = 2; x < nWidth - 2; x++)
+		{
+			CCameraDevice::TColorComponent Color =
+				CCameraDevice::GetFormatColor (Format, x, y);
+			const int (*pNeighbour)[2] =
+				   Color == CCameraDevice::GR || Color == CCameraDevice::GB
+				 ? NeighboursGreen : NeighboursRedBlue;
+
+			const unsigned nValue = Fetch (pLine, x);
+			unsigned nMin = ~0U, nMax = 0;
+			for (unsigned i = 0; i < 4; i++)
+			{
+				const T *pNeighbourLine = reinterpret_cast<const T *> (
+					pBuffer + (y + pNeighbour[i][1]) * nBytesPerLine);
+				unsigned nNeighbour = Fetch (pNeighbourLine, x + pNeighbour[i][0]);
+
+				if (nMin > nNeighbour) nMin = nNeighbour;
+				if (nMax < nNeighbour) nMax = nNeighbour;
+			}
+
+			if (   nValue > nMax + nThreshold
+			    || nValue + nThreshold < nMin)
+			{
+				if (!pDevice->AddDefect (x, y))
+				{
+					return;		// defect map full
+				}
+			}
+		}
+	}
+}
+
+// Replaces the pixel at x / y with the mean of its neighbours with the same color,
+// which are located inside of the frame.
+template <typename T>
+static void CorrectDefect (u8 *pBuffer, unsigned nBytesPerLine, unsigned nWidth,
+			   unsigned nHeight, CCameraDevice::TFormatCode Format,
+			   unsigned x, unsigned y)
+{
+	CCameraDevice::TColorComponent Color = CCameraDevice::GetFormatColor (Format, x, y);
+	const int (*pNeighbour)[2] =    Color == CCameraDevice::GR || Color == CCameraDevice::GB
+				      ? NeighboursGreen : NeighboursRedBlue;
+
+	unsigned nSum = 0, nCount = 0;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		unsigned nx = x + pNeighbour[i][0];
+		unsigned ny = y + pNeighbour[i][1];
+		if (nx >= nWidth || ny >= nHeight)	// also catches negative positions
+		{
+			continue;
+		}
+
+		nSum += Fetch (reinterpret_cast<const T *> (pBuffer + ny * nBytesPerLine), nx);
+		nCount++;
+	}
+
+	if (nCount)
+	{
+		Store (reinterpret_cast<T *> (pBuffer + y * nBytesPerLine), x,
+		       (nSum + nCount / 2) / nCount);
+	}
+}
+
+void CCameraBuffer::FindDefects (unsigned nThreshold, CCameraDevice *pDevice) const
+{
+	assert (pDevice);
+	assert (m_pBuffer);
+	assert (m_nWidth > 4 && m_nHeight > 4);
+
+	nThreshold >>= 10 - CCameraDevice::GetFormatDepth (m_Format);
+
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		FindDefectsInFrame<TRAW10Group> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+						 m_Format, nThreshold, pDevice);
+	}
+	else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+	{
+		FindDefectsInFrame<u8> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					m_Format, nThreshold, pDevice);
+	}
+	else
+	{
+		FindDefectsInFrame<u16> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					 m_Format, nThreshold, pDevice);
+	}
+}
+
+// Called by CCameraDevice for each new frame, before the first reference to the
+// buffer is handed out, so that the conversions and GetPixel(), which may run on
+// multiple cores for multiple consumers, do not modify the buffer any more.
+void CCameraBuffer::Prepare (void)
+{
+	if (!m_bPrepared)
+	{
+		CorrectDefects ();
+	}
+
+	UpdateColorTables ();
+
+	m_bPrepared = true;
+}
+
+// Patches the defective pixels from the defect map of the device in place. This is
+// done once per frame by Prepare(), so that all consumers see the same raw data.
+void CCameraBuffer::CorrectDefects (void)
+{
+	if (!m_pDevice)
+	{
+		return;
+	}
+
+	const unsigned nDefects = m_pDevice->m_nDefects;
+	const CCameraDevice::TDefect *pDefect = m_pDevice->m_Defect;
+	const bool bPacked = CCameraDevice::IsFormatPacked (m_Format);
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+
+	for (unsigned i = 0; i < nDefects; i++, pDefect++)
+	{
+		if (   pDefect->x >= m_nWidth
+		    || pDefect->y >= m_nHeight)
+		{
+			continue;
+		}
+
+		if (bPacked)
+		{
+			CorrectDefect<TRAW10Group> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+						    m_Format, pDefect->x, pDefect->y);
+		}
+		else if (nDepth == 8)
+		{
+			CorrectDefect<u8> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					   m_Format, pDefect->x, pDefect->y);
+		}
+		else
+		{
+			CorrectDefect<u16> (m_pBuffer, m_nBytesPerLine, m_nWidth, m_nHeight,
+					    m_Format, pDefect->x, pDefect->y);
+		}
+	}
+}
+
+void CCameraBuffer::ConvertFrame (TConvertJob *pJob)
+{
+	assert (m_bPrepared);
+
+	assert (pJob);
+	assert (m_nWidth);
+	assert (m_nHeight);
+
+	// the YUV formats are processed in pairs of rows
+	unsigned nRows = pJob->Format < PixelFormatYUYV ? pJob->Rect.Height >> pJob->nScaleShift
+							 : pJob->Rect.Height / 2;
+
+#ifdef ARM_ALLOW_MULTI_CORE
+	CCameraMultiCore *pMultiCore = CCameraMultiCore::Get ();
+	if (pMultiCore)
+	{
+		pMultiCore->Execute (ConvertRowsStub, pJob, nRows);
+
+		return;
+	}
+#endif
+
+	ConvertRows (pJob, 0, nRows);
+}
+
+static unsigned GetBytesPerPixel (CCameraBuffer::TPixelFormat Format)
+{
+	switch (Format)
+	{
+	case CCameraBuffer::PixelFormatRGB565:		return 2;
+	case CCameraBuffer::PixelFormatRGB888:		return 3;
+	case CCameraBuffer::PixelFormatBGRA8888:	return 4;
+	case CCameraBuffer::PixelFormatGray8:		return 1;
+	case CCameraBuffer::PixelFormatGray16:		return 2;
+
+	default:
+		assert (0);
+		return 0;
+	}
+}
+
+// The rows are output rows, counted relative to the top of the source region.
+void CCameraBuffer::ConvertRows (const TConvertJob *pJob, unsigned nFirstRow, unsigned nLastRow)
+{
+	assert (pJob);
+
+	if (pJob->Format >= PixelFormatYUYV)
+	{
+		ConvertRowsYUV (pJob, nFirstRow, nLastRow);
+
+		return;
+	}
+
+	assert (nLastRow <= pJob->Rect.Height >> pJob->nScaleShift);
+
+	const unsigned nShift = pJob->nScaleShift;
+	const unsigned nWidth = pJob->Rect.Width >> nShift;
+
+	// the gray formats are calculated from the white balanced colors only, at full
+	// resolution directly from the Bayer values (incl. black level and lens shading)
+	const bool bCorrect = m_bColorMatrix && pJob->Format < PixelFormatGray8;
+	const bool bDirectGray = pJob->Format >= PixelFormatGray8;
+
+	const unsigned nBytesPerPixel = GetBytesPerPixel (pJob->Format);
+	const unsigned nTileWidth = TILE_WIDTH >> nShift;	// output pixels
+
+	// number of lines below a row, which are read by the demosaic
+	const unsigned nReach =   nShift ? 0
+				: (m_DemosaicMethod == CCameraDevice::DemosaicGradient ? 2 : 1);
+
+	// The gradient demosaic unpacks each source line once per tile into a ring. It
+	// is too big for the stack of a task and is allocated on this path only.
+	TLineRing *pRing = nullptr;
+	if (   nReach == 2
+	    && !bDirectGray)
+	{
+		pRing = new TLineRing;
+		assert (pRing);
+		pRing->nRow = -1;
+	}
+
+	TSpan Span;
+	for (unsigned nTileRow = nFirstRow; nTileRow < nLastRow; nTileRow += TILE_HEIGHT)
+	{
+		const unsigned nTileEnd =   nLastRow - nTileRow < TILE_HEIGHT
+					  ? nLastRow : nTileRow + TILE_HEIGHT;
+
+		for (unsigned nTile = 0; nTile < nWidth; nTile += nTileWidth)
+		{
+			const unsigned nTileEndX =   nWidth - nTile < nTileWidth
+						   ? nWidth : nTile + nTileWidth;
+			const unsigned xTile = pJob->Rect.Left + (nTile << nShift);
+
+			for (unsigned nRow = nTileRow; nRow < nTileEnd; nRow++)
+			{
+				const unsigned y = pJob->Rect.Top + (nRow << nShift);
+				u8 *pOut = pJob->pOutBuffer + nRow * pJob->nPitch + nTile * nBytesPerPixel;
+
+				// the source lines, which are needed additionally for the next row
+				PrefetchLines (xTile, y + (1 << nShift) + nReach,
+					       (nTileEndX - nTile) << nShift, 1 << nShift,
+					       DATA_CACHE_LINE_LENGTH_MIN);
+
+				if (pRing)
+				{
+					AdvanceRing (pRing, xTile, y, nTileEndX - nTile);
+				}
+
+				for (unsigned i = nTile; i < nTileEndX; i += SpanMax)
+				{
+					unsigned nCount = nTileEndX - i < SpanMax ? nTileEndX - i : SpanMax;
+					unsigned x = pJob->Rect.Left + (i << nShift);
+
+					if (nShift)
+					{
+						BinSpan (x, y, nCount, nShift, &Span);
+					}
+					else if (bDirectGray)
+					{
+						pOut = GraySpan (x, y, nCount, pJob->Format, pOut);
+
+						continue;
+					}
+					else if (pRing)
+					{
+						DemosaicSpanRing (*pRing, x, y, nCount, &Span);
+					}
+					else
+					{
+						DemosaicSpan (x, y, nCount, &Span);
+					}
+
+					if (m_bShading)
+					{
+						ShadeSpan (x, y, nCount, nShift, &Span);
+					}
+
+					if (bCorrect)
+					{
+						CorrectSpan (&Span, nCount);
+					}
+
+					pOut = PackSpan (Span, nCount, pJob->Format, pOut);
+				}
+			}
+		}
+	}
+
+	delete pRing;
+}
+
+// The rows are pairs of output rows here. The chroma of a pair is calculated from
+// the Bayer quads, the luma from the demosaiced rows.
+void CCameraBuffer::ConvertRowsYUV (const TConvertJob *pJob, unsigned nFirstPair,
+				    unsigned nLastPair)
+{
+	assert (pJob);
+	assert (nLastPair <= pJob->Rect.Height / 2);
+
+	const TPixelFormat Format = pJob->Format;
+	const CCameraDevice::TRect &Rect = pJob->Rect;
+	const unsigned nPitch = pJob->nPitch;
+
+	// chroma planes of NV12 and I420
+	const unsigned nChromaPitch = Format == PixelFormatI420 ? nPitch / 2 : nPitch;
+	u8 *pPlaneU = pJob->pOutBuffer + nPitch * Rect.Height;
+	u8 *pPlaneV = pPlaneU + nChromaPitch * Rect.Height / 2;
+
+	const unsigned nReach = m_DemosaicMethod == CCameraDevice::DemosaicGradient ? 2 : 1;
+	const unsigned nTilePairs = TILE_HEIGHT / 2;
+
+	// the gradient demosaic unpacks each source line once per tile into a ring
+	TLineRing *pRing = nullptr;
+	if (nReach == 2)
+	{
+		pRing = new TLineRing;
+		assert (pRing);
+		pRing->nRow = -1;
+	}
+
+	TSpan Span;
+	u8 Y[SpanMax], U[SpanMax / 2], V[SpanMax / 2];
+	for (unsigned nTilePair = nFirstPair; nTilePair < nLastPair; nTilePair += nTilePairs)
+	{
+		const unsigned nTileEnd =   nLastPair - nTilePair < nTilePairs
+					  ? nLastPair : nTilePair + nTilePairs;
+
+		for (unsigned nTile = 0; nTile < Rect.Width; nTile += TILE_WIDTH)
+		{
+			const unsigned nTileEndX =   Rect.Width - nTile < TILE_WIDTH
+						   ? Rect.Width : nTile + TILE_WIDTH;
+
+			for (unsigned nPair = nTilePair; nPair < nTileEnd; nPair++)
+			{
+				const unsigned y = Rect.Top + 2 * nPair;
+
+				// the source lines, which are needed additionally for the next pair
+				PrefetchLines (Rect.Left + nTile, y + 2 + nReach, nTileEndX - nTile, 2,
+					       DATA_CACHE_LINE_LENGTH_MIN);
+
+				if (pRing)
+				{
+					AdvanceRing (pRing, Rect.Left + nTile, y, nTileEndX - nTile);
+				}
+
+				for (unsigned i = nTile; i < nTileEndX; i += SpanMax)
+				{
+					unsigned nCount = nTileEndX - i < SpanMax ? nTileEndX - i : SpanMax;
+					unsigned x = Rect.Left + i;
+
+					BinSpan (x, y, nCount / 2, 1, &Span);
+					if (m_bShading)
+					{
+						ShadeSpan (x, y, nCount / 2, 1, &Span);
+					}
+					if (m_bColorMatrix)
+					{
+						CorrectSpan (&Span, nCount / 2);
+					}
+
+					switch (Format)
+					{
+					case PixelFormatNV12: {
+						u8 *pUV = pPlaneU + nPair * nChromaPitch + i;
+						PackChroma (Span, nCount / 2, pUV, pUV + 1, 2);
+						} break;
+
+					case PixelFormatI420:
+						PackChroma (Span, nCount / 2, pPlaneU + nPair * nChromaPitch + i / 2,
+							    pPlaneV + nPair * nChromaPitch + i / 2, 1);
+						break;
+
+					default:
+						PackChroma (Span, nCount / 2, U, V, 1);
+						break;
+					}
+
+					for (unsigned nRow = 2 * nPair; nRow < 2 * nPair + 2; nRow++)
+					{
+						if (pRing)
+						{
+							DemosaicSpanRing (*pRing, x, Rect.Top + nRow, nCount,
+									  &Span);
+						}
+						else
+						{
+							DemosaicSpan (x, Rect.Top + nRow, nCount, &Span);
+						}
+						if (m_bShading)
+						{
+							ShadeSpan (x, Rect.Top + nRow, nCount, 0, &Span);
+						}
+						if (m_bColorMatrix)
+						{
+							CorrectSpan (&Span, nCount);
+						}
+
+						u8 *pLine = pJob->pOutBuffer + nRow * nPitch;
+						if (Format != PixelFormatYUYV)
+						{
+							PackLuma (Span, nCount, pLine + i);
+
+							continue;
+						}
+
+						PackLuma (Span, nCount, Y);
+
+						u8 *pOut = pLine + 2 * i;
+						for (unsigned j = 0; j < nCount / 2; j++)
+						{
+							*pOut++ = Y[2 * j];
+							*pOut++ = U[j];
+							*pOut++ = Y[2 * j + 1];
+							*pOut++ = V[j];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	delete pRing;
+}
+
+// Issues prefetch hints for the source pixels x to x+nCount-1 of nLines lines from
+// line y on, as far as they are inside of the frame, every nStep bytes.
+void CCameraBuffer::PrefetchLines (unsigned x, unsigned y, unsigned nCount, unsigned nLines,
+				   unsigned nStep) const
+{
+	assert (nStep);
+
+	unsigned nFirst, nEnd;			// byte offsets in a line
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		nFirst = x / 4 * sizeof (TRAW10Group);
+		nEnd = (x + nCount + 3) / 4 * sizeof (TRAW10Group);
+	}
+	else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+	{
+		nFirst = x;
+		nEnd = x + nCount;
+	}
+	else
+	{
+		nFirst = x * sizeof (u16);
+		nEnd = (x + nCount) * sizeof (u16);
+	}
+
+	nFirst &= ~(DATA_CACHE_LINE_LENGTH_MIN - 1);
+
+	for (; nLines && y < m_nHeight; nLines--, y++)
+	{
+		const u8 *pLine = m_pBuffer + y * m_nBytesPerLine;
+
+		for (unsigned i = nFirst; i < nEnd; i += nStep)
+		{
+			PREFETCH (pLine + i);
+		}
+	}
+}
+
+void CCameraBuffer::ConvertRowsStub (unsigned nFirstRow, unsigned nLastRow, void *pParam)
+{
+	TConvertJob *pJob = static_cast<TConvertJob *> (pParam);
+	assert (pJob);
+
+	assert (pJob->pThis);
+	pJob->pThis->ConvertRows (pJob, nFirstRow, nLastRow);
+}
+
+// The following kernels are used to convert whole frames. They produce the same
+// result as GetPixel() and friends, but all per-frame constants are calculated
+// once and the Bayer phase is resolved per span, not per pixel.
+
+// Interpolation of the missing color components of a pixel with a red or blue
+// color filter. "Own" is the color of this filter, "Other" the opposite one.
+template <typename T>
+static inline void DemosaicRedBlue (const T *pAbove, const T *pRow, const T *pBelow, int i,
+				    u16 *pOwn, u16 *pGreen, u16 *pOther)
+{
+	pOwn[i] = pRow[i];
+	pGreen[i] = (pAbove[i] + pBelow[i] + pRow[i-1] + pRow[i+1]) / 4;
+	pOther[i] = (pAbove[i-1] + pAbove[i+1] + pBelow[i-1] + pBelow[i+1]) / 4;
+}
+
+// Interpolation of the missing color components of a pixel with a green color
+// filter. "Own" is the other color in the same row, "Other" the one in the rows
+// above and below.
+template <typename T>
+static inline void DemosaicGreen (const T *pAbove, const T *pRow, const T *pBelow, int i,
+				  u16 *pOwn, u16 *pGreen, u16 *pOther)
+{
+	pOwn[i] = (pRow[i-1] + pRow[i+1]) / 2;
+	pGreen[i] = pRow[i];
+	pOther[i] = (pAbove[i] + pBelow[i]) / 2;
+}
+
+#ifdef CAMERA_NEON
+
+// Loads eight Bayer values into 16-bit lanes.
+static inline uint16x8_t LoadVector (const u16 *p)
+{
+	return vld1q_u16 (p);
+}
+
+static inline uint16x8_t LoadVector (const u8 *p)
+{
+	return vmovl_u8 (vld1_u8 (p));
+}
+
+// Vectorized variant of the pixel pair loop in DemosaicRow(). Processes blocks of
+// eight pixels, starting at index i with a red or blue pixel. All interpolations
+// are calculated for all lanes and the results are selected by the lane parity.
+// The sums cannot overflow, because the color depth is 10 bits at most.
+// Returns the index of the first pixel, which has not been processed.
+template <typename T>
+static unsigned DemosaicVector (const T *pAbove, const T *pRow, const T *pBelow,
+				unsigned i, unsigned nCount,
+				u16 *pOwn, u16 *pGreen, u16 *pOther)
+{
+	static const u16 RedBlueLanes[8] = {0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0};
+	const uint16x8_t RedBlue = vld1q_u16 (RedBlueLanes);
+
+	for (; i + 8 <= nCount; i += 8)
+	{
+		uint16x8_t Center = LoadVector (pRow + i);
+		uint16x8_t Vert = vaddq_u16 (LoadVector (pAbove + i), LoadVector (pBelow + i));
+		uint16x8_t Horz = vaddq_u16 (LoadVector (pRow + i - 1), LoadVector (pRow + i + 1));
+		uint16x8_t Diag = vaddq_u16 (vaddq_u16 (LoadVector (pAbove + i - 1),
+							LoadVector (pAbove + i + 1)),
+					     vaddq_u16 (LoadVector (pBelow + i - 1),
+							LoadVector (pBelow + i + 1)));
+
+		uint16x8_t Cross = vshrq_n_u16 (vaddq_u16 (Vert, Horz), 2);
+		Diag = vshrq_n_u16 (Diag, 2);
+		Vert = vshrq_n_u16 (Vert, 1);
+		Horz = vshrq_n_u16 (Horz, 1);
+
+		vst1q_u16 (pOwn + i, vbslq_u16 (RedBlue, Center, Horz));
+		vst1q_u16 (pGreen + i, vbslq_u16 (RedBlue, Cross, Center));
+		vst1q_u16 (pOther + i, vbslq_u16 (RedBlue, Diag, Vert));
+	}
+
+	return i;
+}
+
+#endif
+
+// Processes nCount interior pixels of a Bayer row pixel pair by pixel pair.
+template <typename T>
+static void DemosaicRow (const T *pAbove, const T *pRow, const T *pBelow, unsigned nCount,
+			 bool bGreenFirst, u16 *pOwn, u16 *pGreen, u16 *pOther)
+{
+	unsigned i = 0;
+	if (bGreenFirst && nCount)
+	{
+		DemosaicGreen (pAbove, pRow, pBelow, i++, pOwn, pGreen, pOther);
+	}
+
+#ifdef CAMERA_NEON
+	i = DemosaicVector (pAbove, pRow, pBelow, i, nCount, pOwn, pGreen, pOther);
+#endif
+
+	for (; i + 1 < nCount; i += 2)
+	{
+		DemosaicRedBlue (pAbove, pRow, pBelow, i, pOwn, pGreen, pOther);
+		DemosaicGreen (pAbove, pRow, pBelow, i+1, pOwn, pGreen, pOther);
+	}
+
+	if (i < nCount)
+	{
+		DemosaicRedBlue (pAbove, pRow, pBelow, i, pOwn, pGreen, pOther);
+	}
+}
+
+// Interpolates a pixel in the first or last column of a frame. The column next to
+// it is mirrored, which keeps the Bayer phase. ya and yb are the (mirrored) lines
+// above and below.
+template <typename T>
+static void DemosaicBorderPixel (const u8 *pBuffer, unsigned nBytesPerLine,
+				 CCameraDevice::TFormatCode Format,
+				 unsigned x, unsigned y, unsigned ya, unsigned yb,
+				 u16 *pR, u16 *pG, u16 *pB)
+{
+	const unsigned xn = x > 0 ? x - 1 : x + 1;	// the neighbour column
+
+	u16 Window[3][3];				// 3x3 pixels around x / y
+	const unsigned Lines[3] = {ya, y, yb};
+	for (unsigned i = 0; i < 3; i++)
+	{
+		const T *pLine = reinterpret_cast<const T *> (pBuffer + Lines[i] * nBytesPerLine);
+
+		Window[i][0] = Window[i][2] = Fetch (pLine, xn);
+		Window[i][1] = Fetch (pLine, x);
+	}
+
+	CCameraDevice::TColorComponent Color = CCameraDevice::GetFormatColor (Format, x, y);
+	bool bRedRow = Color == CCameraDevice::R || Color == CCameraDevice::GR;
+
+	u16 *pOwn = bRedRow ? pR : pB;
+	u16 *pOther = bRedRow ? pB : pR;
+
+	if (Color == CCameraDevice::GR || Color == CCameraDevice::GB)
+	{
+		DemosaicGreen (Window[0] + 1, Window[1] + 1, Window[2] + 1, 0, pOwn, pG, pOther);
+	}
+	else
+	{
+		DemosaicRedBlue (Window[0] + 1, Window[1] + 1, Window[2] + 1, 0, pOwn, pG, pOther);
+	}
+}
+
+// The interior pixels are processed by DemosaicRow() without any bounds checks. The
+// border lines are handled by mirroring the line pointers, the border columns by
+// DemosaicBorderPixel().
+void CCameraBuffer::DemosaicSpan (unsigned x, unsigned y, unsigned nCount, TSpan *pSpan) const
+{
+	assert (nCount <= SpanMax);
+	assert (x + nCount <= m_nWidth);
+	assert (m_nWidth >= 2 && m_nHeight >= 2);
+	assert (pSpan);
+
+	if (m_DemosaicMethod == CCameraDevice::DemosaicGradient)
+	{
+		u16 Lines[5][SpanMax + 4];
+		u16 *pLine[5];
+		for (unsigned i = 0; i < 5; i++)
+		{
+			pLine[i] = Lines[i];
+		}
+
+		FetchWindow (x, y, nCount, pLine);
+
+		for (unsigned i = 0; i < 5; i++)
+		{
+			pLine[i] += 2;
+		}
+
+		DemosaicSpanGradient (pLine, x, y, nCount, pSpan);
+
+		return;
+	}
+
+	// the lines above and below, mirrored at the top and bottom border
+	const unsigned ya = y > 0 ? y - 1 : y + 1;
+	const unsigned yb = y < m_nHeight - 1 ? y + 1 : y - 1;
+
+	const bool bPacked = CCameraDevice::IsFormatPacked (m_Format);
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+
+	// the span indices of the border columns, if any
+	unsigned nBorder[2];
+	unsigned nBorders = 0;
+	if (x == 0)
+	{
+		nBorder[nBorders++] = 0;
+	}
+	if (x + nCount == m_nWidth && nCount > 0)
+	{
+		nBorder[nBorders++] = nCount - 1;
+	}
+
+	for (unsigned j = 0; j < nBorders; j++)
+	{
+		const unsigned i = nBorder[j];
+
+		if (bPacked)
+		{
+			DemosaicBorderPixel<TRAW10Group> (m_pBuffer, m_nBytesPerLine, m_Format,
+							  x + i, y, ya, yb,
+							  pSpan->R + i, pSpan->G + i, pSpan->B + i);
+		}
+		else if (nDepth == 8)
+		{
+			DemosaicBorderPixel<u8> (m_pBuffer, m_nBytesPerLine, m_Format,
+						 x + i, y, ya, yb,
+						 pSpan->R + i, pSpan->G + i, pSpan->B + i);
+		}
+		else
+		{
+			DemosaicBorderPixel<u16> (m_pBuffer, m_nBytesPerLine, m_Format,
+						  x + i, y, ya, yb,
+						  pSpan->R + i, pSpan->G + i, pSpan->B + i);
+		}
+	}
+
+	const unsigned nStart = x == 0 ? 1 : 0;
+	const unsigned nEnd = x + nCount == m_nWidth ? nCount - 1 : nCount;
+	if (nStart >= nEnd)
+	{
+		return;
+	}
+
+	CCameraDevice::TColorComponent Color =
+		CCameraDevice::GetFormatColor (m_Format, x + nStart, y);
+	bool bGreenFirst = Color == CCameraDevice::GR || Color == CCameraDevice::GB;
+	bool bRedRow = Color == CCameraDevice::R || Color == CCameraDevice::GR;
+
+	u16 *pOwn = (bRedRow ? pSpan->R : pSpan->B) + nStart;
+	u16 *pOther = (bRedRow ? pSpan->B : pSpan->R) + nStart;
+
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		// unpack the needed part of the three lines, incl. the neighbour columns
+		u16 Lines[3][SpanMax + 2];
+		for (unsigned i = 0; i < 3; i++)
+		{
+			const unsigned nLine = i == 0 ? ya : (i == 1 ? y : yb);
+
+			UnpackRAW10 (reinterpret_cast<const TRAW10Group *> (
+					m_pBuffer + nLine * m_nBytesPerLine),
+				     x + nStart - 1, nEnd - nStart + 2, Lines[i]);
+		}
+
+		DemosaicRow (Lines[0] + 1, Lines[1] + 1, Lines[2] + 1, nEnd - nStart, bGreenFirst,
+			     pOwn, pSpan->G + nStart, pOther);
+	}
+	else if (nDepth == 8)
+	{
+		const u8 *pLine = m_pBuffer + x + nStart;
+
+		DemosaicRow (pLine + ya * m_nBytesPerLine, pLine + y * m_nBytesPerLine,
+			     pLine + yb * m_nBytesPerLine, nEnd - nStart, bGreenFirst,
+			     pOwn, pSpan->G + nStart, pOther);
+	}
+	else
+	{
+		const u8 *pLine = m_pBuffer + (x + nStart) * sizeof (u16);
+
+		DemosaicRow (reinterpret_cast<const u16 *> (pLine + ya * m_nBytesPerLine),
+			     reinterpret_cast<const u16 *> (pLine + y * m_nBytesPerLine),
+			     reinterpret_cast<const u16 *> (pLine + yb * m_nBytesPerLine),
+			     nEnd - nStart, bGreenFirst, pOwn, pSpan->G + nStart, pOther);
+	}
+}
+
+// pLine[0..4] point to the unpacked values at x in the lines y-2 to y+2, which must be
+// valid from x-2 to x+nCount+1. There are no bounds checks in the kernel.
+void CCameraBuffer::DemosaicSpanGradient (const u16 *const pLine[5], unsigned x, unsigned y,
+					  unsigned nCount, TSpan *pSpan) const
+{
+	assert (nCount <= SpanMax);
+	assert (x + nCount <= m_nWidth);
+	assert (pSpan);
+
+	CCameraDevice::TColorComponent Color = CCameraDevice::GetFormatColor (m_Format, x, y);
+	bool bGreenFirst = Color == CCameraDevice::GR || Color == CCameraDevice::GB;
+	bool bRedRow = Color == CCameraDevice::R || Color == CCameraDevice::GR;
+	const int nMax = (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1;
+
+	DemosaicGradientRow (pLine, nCount, bGreenFirst, nMax,
+			     bRedRow ? pSpan->R : pSpan->B, pSpan->G,
+			     bRedRow ? pSpan->B : pSpan->R);
+}
+
+// Fetches the lines y-2 to y+2 from horizontal position x-2 to x+nCount+1 into the
+// line buffers pLine[0..4]. The lines outside of the frame are mirrored.
+void CCameraBuffer::FetchWindow (unsigned x, unsigned y, unsigned nCount, u16 *pLine[5]) const
+{
+	assert (m_nWidth >= 3 && m_nHeight >= 3);
+
+	for (unsigned i = 0; i < 5; i++)
+	{
+		FetchLine (x, (int) (y + i) - 2, nCount, pLine[i]);
+	}
+}
+
+// Fetches line nLine from horizontal position x-2 to x+nCount+1 into pOut. Lines
+// outside of the frame are mirrored.
+void CCameraBuffer::FetchLine (unsigned x, int nLine, unsigned nCount, u16 *pOut) const
+{
+	if (nLine < 0)
+	{
+		nLine = -nLine;
+	}
+	else if (nLine >= (int) m_nHeight)
+	{
+		nLine = 2 * (m_nHeight - 1) - nLine;
+
+		if (nLine < 0)
+		{
+			nLine = 0;		// unused line y+3 of the ring in a frame of 3 lines
+		}
+	}
+
+	assert (nLine >= 0 && nLine < (int) m_nHeight);
+	const u8 *pData = m_pBuffer + nLine * m_nBytesPerLine;
+
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		GatherLine (reinterpret_cast<const TRAW10Group *> (pData), m_nWidth,
+			    x, nCount, pOut);
+	}
+	else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+	{
+		GatherLine (pData, m_nWidth, x, nCount, pOut);
+	}
+	else
+	{
+		GatherLine (reinterpret_cast<const u16 *> (pData), m_nWidth, x, nCount, pOut);
+	}
+}
+
+// Lets the ring hold the lines y-2 to y+3 of the tile from x with nCount pixels. If
+// it held the lines for a row above before, only the lines, which are new, are
+// unpacked, so that each source line is unpacked once per tile.
+void CCameraBuffer::AdvanceRing (TLineRing *pRing, unsigned x, unsigned y, unsigned nCount) const
+{
+	static_assert (TILE_WIDTH + 4 <= TLineRing::MaxWidth, "Line ring too small");
+
+	assert (pRing);
+	assert (nCount + 4 <= TLineRing::MaxWidth);
+
+	const unsigned nLines = TLineRing::Lines;
+
+	unsigned nNew = nLines;				// lines to be fetched
+	if (   pRing->nRow >= 0
+	    && pRing->nX == x
+	    && pRing->nCount == nCount
+	    && y >= (unsigned) pRing->nRow
+	    && y - pRing->nRow < nLines)
+	{
+		nNew = y - pRing->nRow;
+	}
+	else
+	{
+		pRing->nFirst = 0;
+	}
+
+	// the oldest lines are replaced with the new ones at the end of the window
+	for (unsigned i = nLines - nNew; i < nLines; i++)
+	{
+		unsigned nIndex = (pRing->nFirst + i + nNew) % nLines;
+
+		FetchLine (x, (int) (y + i) - 2, nCount, pRing->Line[nIndex]);
+	}
+
+	pRing->nFirst = (pRing->nFirst + nNew) % nLines;
+	pRing->nRow = y;
+	pRing->nX = x;
+	pRing->nCount = nCount;
+}
+
+// Demosaics nCount pixels of row y (the first or second row of the ring) from x.
+void CCameraBuffer::DemosaicSpanRing (const TLineRing &Ring, unsigned x, unsigned y,
+				      unsigned nCount, TSpan *pSpan) const
+{
+	assert (Ring.nRow >= 0);
+	assert (y - Ring.nRow < TLineRing::Lines - 4);
+	assert (x >= Ring.nX && x + nCount <= Ring.nX + Ring.nCount);
+
+	const u16 *pLine[5];
+	for (unsigned i = 0; i < 5; i++)
+	{
+		unsigned nIndex = (Ring.nFirst + y - Ring.nRow + i) % TLineRing::Lines;
+
+		pLine[i] = Ring.Line[nIndex] + (x - Ring.nX) + 2;
+	}
+
+	DemosaicSpanGradient (pLine, x, y, nCount, pSpan);
+}
+
+// Sums up the Bayer quads of nCount blocks of (1 << nScaleShift)^2 values each,
+// starting at the even position x / y. nPosX[] and nPosY[] are the positions of
+// the color components inside of a quad.
+template <typename T>
+static void BinRow (const u8 *pBuffer, unsigned nBytesPerLine, unsigned x, unsigned y,
+		    const unsigned nPosX[4], const unsigned nPosY[4],
+		    unsigned nCount, unsigned nScaleShift, u16 *pR, u16 *pG, u16 *pB)
+{
+	const unsigned nQuads = 1 << (nScaleShift - 1);		// per direction
+	const unsigned nNormShift = 2 * (nScaleShift - 1);	// divide by nQuads^2
+
+	for (unsigned i = 0; i < nCount; i++, x += 1 << nScaleShift)
+	{
+		unsigned nR = 0, nG = 0, nB = 0;
+
+		for (unsigned qy = y; qy < y + 2 * nQuads; qy += 2)
+		{
+			const T *pLine[2] =
+			{
+				reinterpret_cast<const T *> (pBuffer + qy * nBytesPerLine),
+				reinterpret_cast<const T *> (pBuffer + (qy + 1) * nBytesPerLine)
+			};
+
+			for (unsigned qx = x; qx < x + 2 * nQuads; qx += 2)
+			{
+				nR += Fetch (pLine[nPosY[CCameraDevice::R]], qx + nPosX[CCameraDevice::R]);
+				nG +=   Fetch (pLine[nPosY[CCameraDevice::GR]], qx + nPosX[CCameraDevice::GR])
+				      + Fetch (pLine[nPosY[CCameraDevice::GB]], qx + nPosX[CCameraDevice::GB]);
+				nB += Fetch (pLine[nPosY[CCameraDevice::B]], qx + nPosX[CCameraDevice::B]);
+			}
+		}
+
+		pR[i] = nR >> nNormShift;
+		pG[i] = nG >> (nNormShift + 1);
+		pB[i] = nB >> nNormShift;
+	}
+}
+
+#ifdef CAMERA_NEON
+
+// Loads the eight values at the even positions p[0], p[2], .. p[14].
+static inline uint16x8_t LoadEven (const u16 *p)
+{
+	return vld2q_u16 (p).val[0];
+}
+
+static inline uint16x8_t LoadEven (const u8 *p)
+{
+	return vmovl_u8 (vld2_u8 (p).val[0]);
+}
+
+#endif
+
+// Converts nCount Bayer quads into one pixel each, where the two green values are
+// averaged. pColor[] point to the R, GR, GB and B value of the first quad.
+template <typename T>
+static void QuadRow (const T *const pColor[4], unsigned nCount, u16 *pR, u16 *pG, u16 *pB)
+{
+	const T *pRed = pColor[CCameraDevice::R];
+	const T *pGreenR = pColor[CCameraDevice::GR];
+	const T *pGreenB = pColor[CCameraDevice::GB];
+	const T *pBlue = pColor[CCameraDevice::B];
+
+	unsigned i = 0;
+
+#ifdef CAMERA_NEON
+	// The last quad is left to the scalar loop, because the loads of the colors
+	// at odd positions would read one value beyond the span otherwise.
+	for (; i + 8 < nCount; i += 8)
+	{
+		vst1q_u16 (pR + i, LoadEven (pRed + 2*i));
+		vst1q_u16 (pG + i, vhaddq_u16 (LoadEven (pGreenR + 2*i), LoadEven (pGreenB + 2*i)));
+		vst1q_u16 (pB + i, LoadEven (pBlue + 2*i));
+	}
+#endif
+
+	for (; i < nCount; i++)
+	{
+		pR[i] = pRed[2*i];
+		pG[i] = (pGreenR[2*i] + pGreenB[2*i]) >> 1;
+		pB[i] = pBlue[2*i];
+	}
+}
+
+// Each output pixel is calculated from (1 << nScaleShift-1)^2 Bayer quads, starting at
+// the even source position x / y. The green components of a quad are averaged.
+void CCameraBuffer::BinSpan (unsigned x, unsigned y, unsigned nCount, unsigned nScaleShift,
+			     TSpan *pSpan) const
+{
+	assert (nCount <= SpanMax);
+	assert (!(x & 1) && !(y & 1));
+	assert (1 <= nScaleShift && nScaleShift <= 3);
+	assert (x + (nCount << nScaleShift) <= m_nWidth);
+	assert (y + (1U << nScaleShift) <= m_nHeight);
+	assert (pSpan);
+
+	unsigned nPosX[4], nPosY[4];
+	GetQuadPositions (nPosX, nPosY);
+
+	// fast path for one quad per pixel, which does not need to sum up
+	if (nScaleShift == 1)
+	{
+		if (CCameraDevice::IsFormatPacked (m_Format))
+		{
+			u16 Lines[2][SpanMax * 2];
+			for (unsigned i = 0; i < 2; i++)
+			{
+				UnpackRAW10 (reinterpret_cast<const TRAW10Group *> (
+						m_pBuffer + (y + i) * m_nBytesPerLine),
+					     x, nCount * 2, Lines[i]);
+			}
+
+			const u16 *pColor[4];
+			for (unsigned i = 0; i < 4; i++)
+			{
+				pColor[i] = Lines[nPosY[i]] + nPosX[i];
+			}
+
+			QuadRow (pColor, nCount, pSpan->R, pSpan->G, pSpan->B);
+		}
+		else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+		{
+			const u8 *pColor[4];
+			for (unsigned i = 0; i < 4; i++)
+			{
+				pColor[i] = m_pBuffer + (y + nPosY[i]) * m_nBytesPerLine + x + nPosX[i];
+			}
+
+			QuadRow (pColor, nCount, pSpan->R, pSpan->G, pSpan->B);
+		}
+		else
+		{
+			const u16 *pColor[4];
+			for (unsigned i = 0; i < 4; i++)
+			{
+				pColor[i] = reinterpret_cast<const u16 *> (
+						m_pBuffer + (y + nPosY[i]) * m_nBytesPerLine) + x + nPosX[i];
+			}
+
+			QuadRow (pColor, nCount, pSpan->R, pSpan->G, pSpan->B);
+		}
+
+		return;
+	}
+
+	if (CCameraDevice::IsFormatPacked (m_Format))
+	{
+		BinRow<TRAW10Group> (m_pBuffer, m_nBytesPerLine, x, y, nPosX, nPosY,
+				     nCount, nScaleShift, pSpan->R, pSpan->G, pSpan->B);
+	}
+	else if (CCameraDevice::GetFormatDepth (m_Format) == 8)
+	{
+		BinRow<u8> (m_pBuffer, m_nBytesPerLine, x, y, nPosX, nPosY,
+			    nCount, nScaleShift, pSpan->R, pSpan->G, pSpan->B);
+	}
+	else
+	{
+		BinRow<u16> (m_pBuffer, m_nBytesPerLine, x, y, nPosX, nPosY,
+			     nCount, nScaleShift, pSpan->R, pSpan->G, pSpan->B);
+	}
+}
+
+void CCameraBuffer::GetQuadPositions (unsigned nPosX[4], unsigned nPosY[4]) const
+{
+	for (unsigned i = 0; i < 4; i++)
+	{
+		CCameraDevice::TColorComponent Color =
+			CCameraDevice::GetFormatColor (m_Format, i & 1, i >> 1);
+
+		nPosX[Color] = i & 1;
+		nPosY[Color] = i >> 1;
+	}
+}
+
+// Calculates the luminance of nCount pixels, starting at x / y, from the 2x2 Bayer
+// window, which starts at the respective pixel (one column before at the last one).
+// nWeight[][] are the weights of the window values for an even and an odd column.
+// The weighted sums are shifted right by nShift and clipped to nMax.
+template <typename T, typename TOut>
+static void GrayRow (const u8 *pBuffer, unsigned nBytesPerLine, unsigned nWidth,
+		     unsigned x, unsigned y, unsigned nCount, const unsigned nWeight[2][4],
+		     unsigned nShift, unsigned nMax, TOut *pOut)
+{
+	const T *pLine0 = reinterpret_cast<const T *> (pBuffer + y * nBytesPerLine);
+	const T *pLine1 = reinterpret_cast<const T *> (pBuffer + (y + 1) * nBytesPerLine);
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		unsigned xw = x + i < nWidth - 1 ? x + i : nWidth - 2;
+		const unsigned *pWeight = nWeight[xw & 1];
+
+		unsigned nSum =   pWeight[0] * Fetch (pLine0, xw) + pWeight[1] * Fetch (pLine0, xw + 1)
+				+ pWeight[2] * Fetch (pLine1, xw) + pWeight[3] * Fetch (pLine1, xw + 1);
+		nSum >>= nShift;
+
+		pOut[i] = nSum < nMax ? nSum : nMax;
+	}
+}
+
+// As above, but the black level nBlack is subtracted from the window values before.
+// The weighted sums are multiplied with nStretch (10 fractional bits), or with the
+// lens shading gains pGain[c][i] of the color components c of the window values,
+// if pGain is not nullptr. nColor[][] are the color components of the window values.
+template <typename T, typename TOut>
+static void GrayRowShaded (const u8 *pBuffer, unsigned nBytesPerLine, unsigned nWidth,
+			   unsigned x, unsigned y, unsigned nCount, const unsigned nWeight[2][4],
+			   unsigned nBlack, unsigned nStretch, const unsigned *const pGain[3],
+			   const unsigned nColor[2][4], unsigned nShift, unsigned nMax, TOut *pOut)
+{
+	const T *pLine0 = reinterpret_cast<const T *> (pBuffer + y * nBytesPerLine);
+	const T *pLine1 = reinterpret_cast<const T *> (pBuffer + (y + 1) * nBytesPerLine);
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		unsigned xw = x + i < nWidth - 1 ? x + i : nWidth - 2;
+		const unsigned *pWeight = nWeight[xw & 1];
+
+		unsigned nValue[4] = {Fetch (pLine0, xw), Fetch (pLine0, xw + 1),
+				      Fetch (pLine1, xw), Fetch (pLine1, xw + 1)};
+
+		u64 nSum;
+		if (!pGain)
+		{
+			unsigned nWeighted = 0;
+			for (unsigned j = 0; j < 4; j++)
+			{
+				if (nValue[j] > nBlack)
+				{
+					nWeighted += pWeight[j] * (nValue[j] - nBlack);
+				}
+			}
+
+			nSum = (u64) nWeighted * nStretch;
+		}
+		else
+		{
+			const unsigned *pColor = nColor[xw & 1];
+
+			nSum = 0;
+			for (unsigned j = 0; j < 4; j++)
+			{
+				if (nValue[j] > nBlack)
+				{
+					nSum +=   (u64) (pWeight[j] * (nValue[j] - nBlack))
+						* pGain[pColor[j]][i];
+				}
+			}
+		}
+
+		nSum >>= nShift + 10;
+
+		pOut[i] = nSum < nMax ? nSum : nMax;
+	}
+}
+
+// Calls the respective GrayRow variant for the Bayer format.
+template <typename TOut>
+static void GrayRow (CCameraDevice::TFormatCode Format, const u8 *pBuffer,
+		     unsigned nBytesPerLine, unsigned nWidth, unsigned x, unsigned y,
+		     unsigned nCount, const unsigned nWeight[2][4], bool bShading,
+		     unsigned nBlack, unsigned nStretch, const unsigned *const pGain[3],
+		     const unsigned nColor[2][4], unsigned nShift, unsigned nMax, TOut *pOut)
+{
+	if (CCameraDevice::IsFormatPacked (Format))
+	{
+		if (bShading)
+		{
+			GrayRowShaded<TRAW10Group> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+						    nWeight, nBlack, nStretch, pGain, nColor,
+						    nShift, nMax, pOut);
+		}
+		else
+		{
+			GrayRow<TRAW10Group> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+					      nWeight, nShift, nMax, pOut);
+		}
+	}
+	else if (CCameraDevice::GetFormatDepth (Format) == 8)
+	{
+		if (bShading)
+		{
+			GrayRowShaded<u8> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+					   nWeight, nBlack, nStretch, pGain, nColor,
+					   nShift, nMax, pOut);
+		}
+		else
+		{
+			GrayRow<u8> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+				     nWeight, nShift, nMax, pOut);
+		}
+	}
+	else
+	{
+		if (bShading)
+		{
+			GrayRowShaded<u16> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+					    nWeight, nBlack, nStretch, pGain, nColor,
+					    nShift, nMax, pOut);
+		}
+		else
+		{
+			GrayRow<u16> (pBuffer, nBytesPerLine, nWidth, x, y, nCount,
+				      nWeight, nShift, nMax, pOut);
+		}
+	}
+}
+
+u8 *CCameraBuffer::GraySpan (unsigned x, unsigned y, unsigned nCount, TPixelFormat Format,
+			     u8 *pOut) const
+{
+	assert (x + nCount <= m_nWidth);
+	assert (m_nWidth >= 2 && m_nHeight >= 2);
+
+	// the window starts one line above at the last line
+	if (y >= m_nHeight - 1)
+	{
+		y = m_nHeight - 2;
+	}
+
+	unsigned nFactor[3];
+	GetLumaFactors (nFactor);
+
+	unsigned nWeight[2][4];
+	unsigned nColor[2][4];
+	for (unsigned i = 0; i < 8; i++)
+	{
+		unsigned nColumn = i >> 2;
+		unsigned &rWeight = nWeight[nColumn][i & 3];
+		unsigned &rColor = nColor[nColumn][i & 3];
+
+		switch (CCameraDevice::GetFormatColor (m_Format, nColumn + (i & 1), y + (i >> 1 & 1)))
+		{
+		case CCameraDevice::R:	rWeight = nFactor[0];	  rColor = 0;	break;
+		case CCameraDevice::B:	rWeight = nFactor[2];	  rColor = 2;	break;
+		default:		rWeight = nFactor[1] / 2; rColor = 1;	break;	// two greens
+		}
+	}
+
+	// the black level and lens shading correction is applied to the window values,
+	// without interpolating the missing colors
+	unsigned nStretch = 0;
+	unsigned Gain[3][SpanMax];
+	const unsigned *pGain[3] = {Gain[0], Gain[1], Gain[2]};
+	if (m_bShading)
+	{
+		nStretch = GetStretchFactor ();
+
+		if (m_pLensShading)
+		{
+			GetShadingGains (x, y, nCount, Gain);
+		}
+	}
+
+	const unsigned *const *ppGain = m_pLensShading ? pGain : nullptr;
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+
+	if (Format == PixelFormatGray8)
+	{
+		GrayRow (m_Format, m_pBuffer, m_nBytesPerLine, m_nWidth, x, y, nCount, nWeight,
+			 m_bShading, m_nBlackLevel, nStretch, ppGain, nColor,
+			 nDepth - 8 + 16, 0xFF, pOut);
+
+		return pOut + nCount;
+	}
+
+	assert (Format == PixelFormatGray16);
+	GrayRow (m_Format, m_pBuffer, m_nBytesPerLine, m_nWidth, x, y, nCount, nWeight,
+		 m_bShading, m_nBlackLevel, nStretch, ppGain, nColor,
+		 nDepth, 0xFFFF, reinterpret_cast<u16 *> (pOut));		// scale to 16 bits
+
+	return pOut + nCount * 2;
+}
+
+// Returns the white balanced luminance weights of the R, G and B components
+// (0.299, 0.587, 0.114) with 16 fractional bits.
+void CCameraBuffer::GetLumaFactors (unsigned nFactor[3]) const
+{
+	static const unsigned Weight[3] = {77, 150, 29};	// 8 fractional bits
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		nFactor[i] = Weight[i] * m_ColorFactor[i] >> 8;
+	}
+}
+
+u8 *CCameraBuffer::PackSpan (const TSpan &Span, unsigned nCount, TPixelFormat Format,
+			     u8 *pOut) const
+{
+	switch (Format)
+	{
+	case PixelFormatRGB565:
+		PackRGB565 (Span, nCount, reinterpret_cast<u16 *> (pOut));
+		return pOut + nCount * 2;
+
+	case PixelFormatRGB888:
+		PackRGB888 (Span, nCount, pOut);
+		return pOut + nCount * 3;
+
+	case PixelFormatBGRA8888:
+		PackBGRA8888 (Span, nCount, reinterpret_cast<u32 *> (pOut));
+		return pOut + nCount * 4;
+
+	case PixelFormatGray8:
+		PackGray (Span, nCount, Format, pOut);
+		return pOut + nCount;
+
+	case PixelFormatGray16:
+		PackGray (Span, nCount, Format, pOut);
+		return pOut + nCount * 2;
+
+	default:
+		assert (0);
+		return pOut;
+	}
+}
+
+// The LUTs fuse the white balance factors, clipping, the tone curve of the device
+// and the quantisation to 8 bits. The RGB565 components are truncated from these.
+
+void CCameraBuffer::PackRGB888 (const TSpan &Span, unsigned nCount, u8 *pOut) const
+{
+	const u8 *pLUTR = m_LUT[0];
+	const u8 *pLUTG = m_LUT[1];
+	const u8 *pLUTB = m_LUT[2];
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		*pOut++ = pLUTR[Span.R[i]];
+		*pOut++ = pLUTG[Span.G[i]];
+		*pOut++ = pLUTB[Span.B[i]];
+	}
+}
+
+void CCameraBuffer::PackRGB565 (const TSpan &Span, unsigned nCount, u16 *pOut) const
+{
+	const u8 *pLUTR = m_LUT[0];
+	const u8 *pLUTG = m_LUT[1];
+	const u8 *pLUTB = m_LUT[2];
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		*pOut++ =   (pLUTR[Span.R[i]] >> 3) << 11
+			  | (pLUTG[Span.G[i]] >> 2) << 5
+			  |  pLUTB[Span.B[i]] >> 3;
+	}
+}
+
+void CCameraBuffer::PackBGRA8888 (const TSpan &Span, unsigned nCount, u32 *pOut) const
+{
+	const u8 *pLUTR = m_LUT[0];
+	const u8 *pLUTG = m_LUT[1];
+	const u8 *pLUTB = m_LUT[2];
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		*pOut++ =   0xFF000000U
+			  | (u32) pLUTR[Span.R[i]] << 16
+			  | (u32) pLUTG[Span.G[i]] << 8
+			  |       pLUTB[Span.B[i]];
+	}
+}
+
+void CCameraBuffer::PackGray (const TSpan &Span, unsigned nCount, TPixelFormat Format,
+			      u8 *pOut) const
+{
+	unsigned nFactor[3];
+	GetLumaFactors (nFactor);
+
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+
+	if (Format == PixelFormatGray8)
+	{
+		const unsigned nShift = nDepth - 8 + 16;
+
+		for (unsigned i = 0; i < nCount; i++)
+		{
+			unsigned Y = (  Span.R[i] * nFactor[0] + Span.G[i] * nFactor[1]
+				      + Span.B[i] * nFactor[2]) >> nShift;
+
+			pOut[i] = Y > 0xFF ? 0xFF : Y;
+		}
+
+		return;
+	}
+
+	assert (Format == PixelFormatGray16);
+	u16 *pOut16 = reinterpret_cast<u16 *> (pOut);
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		unsigned Y = (  Span.R[i] * nFactor[0] + Span.G[i] * nFactor[1]
+			      + Span.B[i] * nFactor[2]) >> nDepth;
+
+		pOut16[i] = Y > 0xFFFF ? 0xFFFF : Y;
+	}
+}
+
+// The YUV values are calculated from the 8-bit RGB components from the LUTs
+// with the BT.601 limited range coefficients in 8.8 fixed point.
+
+void CCameraBuffer::PackLuma (const TSpan &Span, unsigned nCount, u8 *pY) const
+{
+	const u8 *pLUTR = m_LUT[0];
+	const u8 *pLUTG = m_LUT[1];
+	const u8 *pLUTB = m_LUT[2];
+
+	for (unsigned i = 0; i < nCount; i++)
+	{
+		unsigned CR = pLUTR[Span.R[i]];
+		unsigned CG = pLUTG[Span.G[i]];
+		unsigned CB = pLUTB[Span.B[i]];
+
+		pY[i] = (66 * CR + 129 * CG + 25 * CB + 128 + (16 << 8)) >> 8;
+	}
+}
+
+// Writes the U and V values with a distance of nStep bytes.
+void CCameraBuffer::PackChroma (const TSpan &Span, unsigned nCount, u8 *pU, u8 *pV,
+				unsigned nStep) const
+{
+	const u8 *pLUTR = m_LUT[0];
+	const u8 *pLUTG = m_LUT[1];
+	const u8 *pLUTB = m_LUT[2];
+
+	for (unsigned i = 0; i < nCount; i++, pU += nStep, pV += nStep)
+	{
+		int CR = pLUTR[Span.R[i]];
+		int CG = pLUTG[Span.G[i]];
+		int CB = pLUTB[Span.B[i]];
+
+		// the results are in the range 16..240
+		*pU = (-38 * CR -  74 * CG + 112 * CB + 128 + (128 << 8)) >> 8;
+		*pV = (112 * CR -  94 * CG -  18 * CB + 128 + (128 << 8)) >> 8;
+	}
+}
+
+// Applies the color correction matrix (with the white balance factors folded in)
+// to the demosaiced or binned colors of a span.
+void CCameraBuffer::CorrectSpan (TSpan *pSpan, unsigned nCount) const
+{
+	assert (pSpan);
+	assert (m_bColorMatrix);
+
+	const int nMax = (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1;
+	const s16 (*M)[3] = m_ColorMatrix;
+
+	unsigned i = 0;
+
+#ifdef CAMERA_NEON
+	const uint16x4_t Max = vdup_n_u16 (nMax);
+
+	for (; i + 4 <= nCount; i += 4)
+	{
+		// the values have 10 bits at most, so they fit into signed lanes
+		int16x4_t R = vreinterpret_s16_u16 (vld1_u16 (pSpan->R + i));
+		int16x4_t G = vreinterpret_s16_u16 (vld1_u16 (pSpan->G + i));
+		int16x4_t B = vreinterpret_s16_u16 (vld1_u16 (pSpan->B + i));
+
+		int32x4_t SumR = vmlal_n_s16 (vmlal_n_s16 (vmull_n_s16 (R, M[0][0]),
+							   G, M[0][1]), B, M[0][2]);
+		int32x4_t SumG = vmlal_n_s16 (vmlal_n_s16 (vmull_n_s16 (R, M[1][0]),
+							   G, M[1][1]), B, M[1][2]);
+		int32x4_t SumB = vmlal_n_s16 (vmlal_n_s16 (vmull_n_s16 (R, M[2][0]),
+							   G, M[2][1]), B, M[2][2]);
+
+		// round, shift and saturate negative results to 0
+		vst1_u16 (pSpan->R + i, vmin_u16 (vqrshrun_n_s32 (SumR, 10), Max));
+		vst1_u16 (pSpan->G + i, vmin_u16 (vqrshrun_n_s32 (SumG, 10), Max));
+		vst1_u16 (pSpan->B + i, vmin_u16 (vqrshrun_n_s32 (SumB, 10), Max));
+	}
+#endif
+
+	for (; i < nCount; i++)
+	{
+		CorrectColor (M, nMax, pSpan->R + i, pSpan->G + i, pSpan->B + i);
+	}
+}
+
+void CCameraBuffer::ShadeSpan (unsigned x, unsigned y, unsigned nCount, unsigned nScaleShift,
+			       TSpan *pSpan) const
+{
+	assert (pSpan);
+
+	u16 *const pColor[3] = {pSpan->R, pSpan->G, pSpan->B};
+
+	ShadeColors (x, y, nCount, nScaleShift, pColor);
+}
+
+// Subtracts the black level and multiplies the colors with the lens shading gains,
+// which are interpolated bilinearly from the grid, and with the factor, which
+// stretches the remaining range to full scale again. Pixel i of the R, G and B
+// arrays is located at x + (i << nScaleShift) / y.
+void CCameraBuffer::ShadeColors (unsigned x, unsigned y, unsigned nCount,
+				 unsigned nScaleShift, u16 *const pColor[3]) const
+{
+	assert (pColor);
+	assert (m_bShading);
+	assert (nCount <= SpanMax);
+
+	const int nMax = (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1;
+	const int nBlack = m_nBlackLevel;
+	assert (nBlack < nMax);
+
+	const int nStretch = GetStretchFactor ();
+
+	if (!m_pLensShading)
+	{
+		for (unsigned c = 0; c < 3; c++)
+		{
+			u16 *p = pColor[c];
+
+			for (unsigned i = 0; i < nCount; i++)
+			{
+				int nValue = p[i] - nBlack;
+				nValue = nValue > 0 ? (nValue * nStretch) >> 10 : 0;
+
+				p[i] = nValue > nMax ? nMax : nValue;
+			}
+		}
+
+		return;
+	}
+
+	typedef CCameraDevice::TLensShading TTable;
+
+	int RowGain[3][TTable::GridWidth + 1];
+	GetRowGains (y, nStretch, RowGain);
+
+	// horizontal grid position with 16 fractional bits
+	const unsigned nStep = ((TTable::GridWidth - 1) << 16) / (m_nWidth - 1);
+	unsigned nPosX = x * nStep;
+
+	for (unsigned i = 0; i < nCount; i++, nPosX += nStep << nScaleShift)
+	{
+		const unsigned gx = nPosX >> 16;
+		const int fx = (nPosX >> 8) & 0xFF;
+		assert (gx < TTable::GridWidth);
+
+		for (unsigned c = 0; c < 3; c++)
+		{
+			int nGain = RowGain[c][gx] + (((RowGain[c][gx + 1] - RowGain[c][gx]) * fx) >> 8);
+
+			int nValue = pColor[c][i] - nBlack;
+			nValue = nValue > 0 ? (nValue * nGain) >> 10 : 0;
+
+			pColor[c][i] = nValue > nMax ? nMax : nValue;
+		}
+	}
+}
+
+// Returns the factor (10 fractional bits), which stretches the range above the black
+// level to full scale again.
+int CCameraBuffer::GetStretchFactor (void) const
+{
+	const int nMax = (1 << CCameraDevice::GetFormatDepth (m_Format)) - 1;
+	assert ((int) m_nBlackLevel < nMax);
+
+	return (nMax << 10) / (nMax - (int) m_nBlackLevel);
+}
+
+// Interpolates the lens shading gains of line y vertically at the grid columns and
+// multiplies them with nStretch (10 fractional bits). The last grid column is
+// repeated once for the horizontal interpolation.
+void CCameraBuffer::GetRowGains (unsigned y, int nStretch,
+				 int RowGain[3][CCameraDevice::TLensShading::GridWidth + 1]) const
+{
+	typedef CCameraDevice::TLensShading TTable;
+	assert (m_pLensShading);
+	assert (m_nWidth > 1 && m_nHeight > 1);
+
+	// vertical grid position with 8 fractional bits
+	unsigned nPosY = (u64) y * ((TTable::GridHeight - 1) << 8) / (m_nHeight - 1);
+	unsigned gy = nPosY >> 8;
+	int fy = nPosY & 0xFF;
+	if (gy >= TTable::GridHeight - 1)
+	{
+		gy = TTable::GridHeight - 2;
+		fy = 0x100;
+	}
+
+	for (unsigned c = 0; c < 3; c++)
+	{
+		const u16 *pAbove = m_pLensShading->Gain[c][gy];
+		const u16 *pBelow = m_pLensShading->Gain[c][gy + 1];
+
+		for (unsigned gx = 0; gx < TTable::GridWidth; gx++)
+		{
+			int nGain = pAbove[gx] + (((pBelow[gx] - pAbove[gx]) * fy) >> 8);
+
+			RowGain[c][gx] = (nGain * nStretch) >> 10;
+		}
+
+		RowGain[c][TTable::GridWidth] = RowGain[c][TTable::GridWidth - 1];
+	}
+}
+
+// Calculates the lens shading gains of the R, G and B components (10 fractional bits,
+// including the stretch factor) for nCount pixels from x / y.
+void CCameraBuffer::GetShadingGains (unsigned x, unsigned y, unsigned nCount,
+				     unsigned Gain[3][SpanMax]) const
+{
+	assert (m_pLensShading);
+	assert (nCount <= SpanMax);
+
+	typedef CCameraDevice::TLensShading TTable;
+
+	int RowGain[3][TTable::GridWidth + 1];
+	GetRowGains (y, GetStretchFactor (), RowGain);
+
+	// horizontal grid position with 16 fractional bits
+	const unsigned nStep = ((TTable::GridWidth - 1) << 16) / (m_nWidth - 1);
+	unsigned nPosX = x * nStep;
+
+	for (unsigned i = 0; i < nCount; i++, nPosX += nStep)
+	{
+		const unsigned gx = nPosX >> 16;
+		const int fx = (nPosX >> 8) & 0xFF;
+		assert (gx < TTable::GridWidth);
+
+		for (unsigned c = 0; c < 3; c++)
+		{
+			Gain[c][i] = RowGain[c][gx] + (((RowGain[c][gx + 1] - RowGain[c][gx]) * fx) >> 8);
+		}
+	}
+}
+
+// Takes over the color correction matrix of the device with the white balance
+// factors folded in, and rebuilds the LUTs, if their white balance factors, the
+// color depth or the tone curve of the device have changed. This is done by Prepare()
+// once per frame and by WhiteBalance().
+void CCameraBuffer::UpdateColorTables (void)
+{
+	static const unsigned UnityFactor[3] = {65536, 65536, 65536};
+	const unsigned *pFactor = m_ColorFactor;
+
+	const CCameraDevice::TColorMatrix *pMatrix =
+		m_pDevice ? m_pDevice->GetColorMatrix () : nullptr;
+	if (pMatrix)
+	{
+		for (unsigned i = 0; i < 3; i++)
+		{
+			for (unsigned j = 0; j < 3; j++)
+			{
+				s64 nCoeff = (s64) pMatrix->Coeff[i][j] * m_ColorFactor[j] / 65536;
+
+				m_ColorMatrix[i][j] =   nCoeff > 32767 ? 32767
+						      : (nCoeff < -32768 ? -32768 : nCoeff);
+			}
+		}
+
+		pFactor = UnityFactor;		// the matrix applies them already
+	}
+
+	m_bColorMatrix = !!pMatrix;
+
+	const unsigned nDepth = CCameraDevice::GetFormatDepth (m_Format);
+
+	m_nBlackLevel = m_pDevice ? m_pDevice->GetBlackLevel () >> (10 - nDepth) : 0;
+	m_pLensShading = m_pDevice ? m_pDevice->GetLensShading () : nullptr;
+	m_bShading = m_nBlackLevel || m_pLensShading;
+	m_DemosaicMethod = m_pDevice ? m_pDevice->GetDemosaicMethod ()
+				     : CCameraDevice::DemosaicBilinear;
+	const unsigned nGeneration = m_pDevice ? m_pDevice->m_nToneCurveGeneration : 0;
+
+	if (   m_nLUTDepth == nDepth
+	    && m_nLUTGeneration == nGeneration
+	    && m_LUTFactor[0] == pFactor[0]
+	    && m_LUTFactor[1] == pFactor[1]
+	    && m_LUTFactor[2] == pFactor[2])
+	{
+		return;
+	}
+
+	assert (nDepth <= 10);
+	const unsigned nEntries = 1 << nDepth;
+
+	// the tone curve has a 12-bit input
+	const unsigned nShift = nDepth - 12 + 16;
+	const unsigned nMax = CCameraDevice::ToneCurveSize - 1;
+	const u8 *pToneCurve = m_pDevice ? m_pDevice->m_ToneCurve : nullptr;
+
+	for (unsigned nColor = 0; nColor < 3; nColor++)
+	{
+		const u64 nFactor = pFactor[nColor];
+
+		for (unsigned i = 0; i < nEntries; i++)
+		{
+			u64 nValue = i * nFactor >> nShift;
+			if (nValue > nMax)
+			{
+				nValue = nMax;
+			}
+
+			m_LUT[nColor][i] = pToneCurve ? pToneCurve[nValue] : nValue >> 4;
+		}
+
+		m_LUTFactor[nColor] = pFactor[nColor];
+	}
+
+	m_nLUTDepth = nDepth;
+	m_nLUTGeneration = nGeneration;
 }
 
 void CCameraBuffer::InvalidateCache (void)
@@ -10,13 +10,50 @@
 #include <camera/camerabuffer.h>
 #include <circle/sched/scheduler.h>
 #include <circle/sysconfig.h>
+#include <circle/synchronize.h>
 #include <circle/atomic.h>
 #include <circle/timer.h>
+#include "math.h"
+
+#ifdef ARM_ALLOW_MULTI_CORE
+	#include <circle/multicore.h>
+	#define THIS_CORE()	CMultiCoreSupport::ThisCore ()
+#else
+	#define THIS_CORE()	0
+#endif
+
+#define WFE()	asm volatile ("wfe" ::: "memory")
+#define SEV()	asm volatile ("sev" ::: "memory")
 
 CCameraDevice::CCameraDevice (void)
 :	m_nBuffers (0),
-	m_pBufferReadyHandler (nullptr)
+	m_nFreeMask (0),
+	m_nReadyIn (0),
+	m_nReadyOut (0),
+	m_pNextBuffer (nullptr),
+	m_pLastDequeued (nullptr),
+	m_nAutoControlsState (AutoControlsIdle),
+	m_QueuePolicy (QueueFIFO),
+	m_nFramesReceived (0),
+	m_nFramesDelivered (0),
+	m_nFramesDroppedNoBuffer (0),
+	m_nFramesDroppedFlush (0),
+	m_nFramesOverwritten (0),
+	m_nQueueDepthMin (0),
+	m_nQueueDepthMax (0),
+	m_nQueueDepthSum (0),
+	m_nQueueDepthSamples (0),
+	m_LatencyHistogram {0},
+	m_pBufferReadyHandler (nullptr),
+	m_nToneCurveGeneration (0),
+	m_WhiteBalance {65536, 65536, 65536},
+	m_nBlackLevel (0),
+	m_bLensShading (false),
+	m_nDefects (0),
+	m_bColorMatrix (false),
+	m_DemosaicMethod (DemosaicBilinear)
 {
+	SetGamma (1.0f);
 }
 
 CCameraDevice::~CCameraDevice (void)
@@ -47,7 +84,57 @@ bool CCameraDevice::AllocateBuffers (unsigned nBuffers)
 
 		m_nBuffers++;
 
-		if (!m_pBuffer[i]->Setup (Info.ImageSize))
+		if (!m_pBuffer[i]->Setup (Info.ImageSize, this))
+		{
+			FreeBuffers ();
+
+			return false;
+		}
+	}
+
+	InitBufferQueue ();
+
+	return true;
+}
+
+bool CCameraDevice::AllocateBuffers (void *const pMemory[], unsigned nBuffers, size_t nSize)
+{
+	assert (!m_nBuffers);
+	assert (pMemory);
+
+	TFormatInfo Info = GetFormatInfo ();
+	assert (Info.ImageSize);
+
+	// the buffer queue needs at least three buffers, see AllocateBuffers() above
+	if (   nBuffers < 3
+	    || nBuffers > MaxBuffers
+	    || nSize < Info.ImageSize)
+	{
+		return false;
+	}
+
+	for (unsigned i = 0; i < nBuffers; i++)
+	{
+		const uintptr nStart = reinterpret_cast<uintptr> (pMemory[i]);
+		for (unsigned j = 0; j < i; j++)
+		{
+			const uintptr nOther = reinterpret_cast<uintptr> (pMemory[j]);
+			if (   nStart < nOther + nSize
+			    && nOther < nStart + nSize)
+			{
+				return false;
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < nBuffers; i++)
+	{
+		m_pBuffer[i] = new CCameraBuffer;
+		assert (m_pBuffer[i]);
+
+		m_nBuffers++;
+
+		if (!m_pBuffer[i]->Setup (pMemory[i], nSize, this))
 		{
 			FreeBuffers ();
 
@@ -55,14 +142,26 @@ bool CCameraDevice::AllocateBuffers (unsigned nBuffers)
 		}
 	}
 
-	m_nInPtr = 0;
-	m_nOutPtr = 0;
+	InitBufferQueue ();
 
 	return true;
 }
 
+void CCameraDevice::InitBufferQueue (void)
+{
+	m_nReadyIn = 0;
+	m_nReadyOut = 0;
+	m_pNextBuffer = nullptr;
+	m_pLastDequeued = nullptr;
+	m_nAutoControlsState = AutoControlsIdle;
+
+	AtomicSet (&m_nFreeMask, (1 << m_nBuffers) - 1);
+}
+
 void CCameraDevice::FreeBuffers (void)
 {
+	AtomicSet (&m_nFreeMask, 0);
+
 	for (unsigned i = 0; i < m_nBuffers; i++)
 	{
 		delete m_pBuffer[i];
@@ -71,26 +170,96 @@ void CCameraDevice::FreeBuffers (void)
 	m_nBuffers = 0;
 }
 
+// The free list is a bit mask, which is updated with compare-exchange, so that the
+// buffers can be returned from any core, while the interrupt handler takes them.
 CCameraBuffer *CCameraDevice::GetFreeBuffer (void)
 {
 	assert (m_nBuffers);
 
-	CCameraBuffer *pBuffer = nullptr;
+	int nMask, nBit;
+	do
+	{
+		nMask = AtomicGet (&m_nFreeMask);
+		if (!nMask)
+		{
+			break;
+		}
+
+		nBit = nMask & -nMask;			// lowest free buffer
+	}
+	while (AtomicCompareExchange (&m_nFreeMask, nMask, nMask & ~nBit) != nMask);
 
-	if ((AtomicGet (&m_nInPtr) + 1) % m_nBuffers != (unsigned) AtomicGet (&m_nOutPtr))
+	int nIndex = 0;
+	if (nMask)
+	{
+		while (!(nBit & (1 << nIndex)))
+		{
+			nIndex++;
+		}
+	}
+	else
 	{
-		pBuffer = m_pBuffer[AtomicGet (&m_nInPtr)];
-		assert (pBuffer);
+		// With QueueLatest the oldest ready buffer, which has not been taken by
+		// the application yet, is overwritten with the new frame.
+		if (   m_QueuePolicy != QueueLatest
+		    || (nIndex = PopReadyBuffer ()) < 0)
+		{
+			return nullptr;
+		}
 
-		pBuffer->InvalidateCache ();
+		AtomicIncrement (&m_nFramesOverwritten);
 	}
 
+	CCameraBuffer *pBuffer = m_pBuffer[nIndex];
+	assert (pBuffer);
+
+	pBuffer->InvalidateCache ();
+
 	return pBuffer;
 }
 
-void CCameraDevice::BufferReady (unsigned nSequence)
+void CCameraDevice::PutFreeBuffer (CCameraBuffer *pBuffer)
 {
-	AtomicSet (&m_nInPtr, (AtomicGet (&m_nInPtr) + 1) % m_nBuffers);
+	const int nBit = 1 << GetBufferIndex (pBuffer);
+
+	int nMask;
+	do
+	{
+		nMask = AtomicGet (&m_nFreeMask);
+		assert (!(nMask & nBit));		// returned twice?
+	}
+	while (AtomicCompareExchange (&m_nFreeMask, nMask, nMask | nBit) != nMask);
+}
+
+void CCameraDevice::BufferReady (CCameraBuffer *pBuffer, unsigned nSequence)
+{
+	const int nIn = AtomicGet (&m_nReadyIn);
+	AtomicSet (&m_ReadyQueue[nIn], GetBufferIndex (pBuffer));
+
+	// The queue cannot overflow, because it can hold all buffers.
+	AtomicSet (&m_nReadyIn, (nIn + 1) % ReadyQueueSize);
+
+	AtomicIncrement (&m_nFramesReceived);
+
+	unsigned nDepth = (nIn + 1 + ReadyQueueSize - AtomicGet (&m_nReadyOut)) % ReadyQueueSize;
+	if (   !m_nQueueDepthSamples
+	    || nDepth < m_nQueueDepthMin)
+	{
+		m_nQueueDepthMin = nDepth;
+	}
+	if (nDepth > m_nQueueDepthMax)
+	{
+		m_nQueueDepthMax = nDepth;
+	}
+	m_nQueueDepthSum += nDepth;
+	m_nQueueDepthSamples++;
+
+	// wake up the waiters in WaitForNextBuffer()
+#ifdef NO_BUSY_WAIT
+	m_BufferReadyEvent.Set ();
+#endif
+	DataSyncBarrier ();
+	SEV ();
 
 	if (m_pBufferReadyHandler)
 	{
@@ -98,38 +267,75 @@ void CCameraDevice::BufferReady (unsigned nSequence)
 	}
 }
 
+void CCameraDevice::FrameDropped (void)
+{
+	AtomicIncrement (&m_nFramesReceived);
+	AtomicIncrement (&m_nFramesDroppedNoBuffer);
+}
+
+// The buffer is taken from the queue here already, so that it cannot be overwritten
+// with QueueLatest, while it is processed. It is held until BufferProcessed().
 CCameraBuffer *CCameraDevice::GetNextBuffer (void)
 {
 	assert (m_nBuffers);
 
-	CCameraBuffer *pBuffer = nullptr;
-
-	if (AtomicGet (&m_nInPtr) != AtomicGet (&m_nOutPtr))
+	if (!m_pNextBuffer)
 	{
-		pBuffer = m_pBuffer[AtomicGet (&m_nOutPtr)];
-		assert (pBuffer);
+		m_pNextBuffer = TakeReadyBuffer ();
 	}
 
-	return pBuffer;
+	return m_pNextBuffer;
 }
 
 CCameraBuffer *CCameraDevice::WaitForNextBuffer (unsigned nTimeoutMs)
 {
 	CTimer *pTimer = CTimer::Get ();
 	unsigned nStartTicks = pTimer->GetClockTicks ();
+	const unsigned nTimeoutTicks = nTimeoutMs * (CLOCKHZ / 1000);
 
 	CCameraBuffer *pBuffer = nullptr;
 	while (!(pBuffer = GetNextBuffer ()))
 	{
+		unsigned nElapsedTicks = pTimer->GetClockTicks () - nStartTicks;
 		if (   nTimeoutMs
-		    && (pTimer->GetClockTicks () - nStartTicks) >= nTimeoutMs * (CLOCKHZ / 1000))
+		    && nElapsedTicks >= nTimeoutTicks)
 		{
 			break;
 		}
 
+		// The scheduler can be used on core 0 only.
+		if (   THIS_CORE () == 0
+		    && CScheduler::IsActive ())
+		{
 #ifdef NO_BUSY_WAIT
-		CScheduler::Get ()->Yield ();
+			// The event may have been set before the check above, so it is
+			// cleared first and the queue is checked again before blocking.
+			m_BufferReadyEvent.Clear ();
+			if (GetNextBuffer ())
+			{
+				continue;
+			}
+
+			if (nTimeoutMs)
+			{
+				m_BufferReadyEvent.WaitWithTimeout (  (nTimeoutTicks - nElapsedTicks)
+								    / (CLOCKHZ / 1000000));
+			}
+			else
+			{
+				m_BufferReadyEvent.Wait ();
+			}
+#else
+			// the other tasks must not starve, until the next frame arrives
+			CScheduler::Get ()->Yield ();
 #endif
+
+			continue;
+		}
+
+		// Sleep until the next event. The interrupts (incl. the timer tick) wake
+		// up the core too, so that the timeout is still checked.
+		WFE ();
 	}
 
 	return pBuffer;
@@ -137,12 +343,258 @@ CCameraBuffer *CCameraDevice::WaitForNextBuffer (unsigned nTimeoutMs)
 
 void CCameraDevice::BufferProcessed (void)
 {
-	AtomicSet (&m_nOutPtr, (AtomicGet (&m_nOutPtr) + 1) % m_nBuffers);
+	CCameraBuffer *pBuffer = DequeueBuffer ();
+	if (pBuffer)
+	{
+		QueueBuffer (pBuffer);
+	}
+}
+
+CCameraBuffer *CCameraDevice::DequeueBuffer (void)
+{
+	assert (m_nBuffers);
+
+	// hand over the buffer from GetNextBuffer(), if any
+	CCameraBuffer *pBuffer = m_pNextBuffer;
+	if (pBuffer)
+	{
+		m_pNextBuffer = nullptr;
+
+		return pBuffer;
+	}
+
+	return TakeReadyBuffer ();
+}
+
+// Takes the oldest ready buffer (the newest with QueueLatest) from the queue and
+// returns it with one reference.
+CCameraBuffer *CCameraDevice::TakeReadyBuffer (void)
+{
+	UpdatePendingAutoControls ();
+
+	int nIndex = PopReadyBuffer ();
+	if (nIndex < 0)
+	{
+		return nullptr;
+	}
+
+	if (m_QueuePolicy == QueueLatest)
+	{
+		int nNewer;
+		while ((nNewer = PopReadyBuffer ()) >= 0)
+		{
+			PutFreeBuffer (m_pBuffer[nIndex]);
+			AtomicIncrement (&m_nFramesOverwritten);
+
+			nIndex = nNewer;
+		}
+	}
+
+	CCameraBuffer *pBuffer = m_pBuffer[nIndex];
+	assert (pBuffer);
+
+	// no other core can access the buffer yet
+	pBuffer->Prepare ();
+
+	assert (!AtomicGet (&pBuffer->m_nRefCount));
+	AtomicSet (&pBuffer->m_nRefCount, 1);
+
+	m_pLastDequeued = pBuffer;
+
+	AtomicIncrement (&m_nFramesDelivered);
+
+	// the timestamp has been taken at frame start
+	unsigned nLatencyMs =   (  CTimer::Get ()->GetClockTicks () / (CLOCKHZ / 1000000)
+			         - pBuffer->GetTimestamp ()) / 1000;
+	unsigned nBin = 0;
+	while (   nLatencyMs
+	       && nBin < TFrameStatistics::LatencyBins-1)
+	{
+		nLatencyMs >>= 1;
+		nBin++;
+	}
+	AtomicIncrement (&m_LatencyHistogram[nBin]);
+
+	return pBuffer;
+}
+
+// Removes the oldest buffer from the ready queue. This may be called from the
+// interrupt handler and from multiple cores.
+int CCameraDevice::PopReadyBuffer (void)
+{
+	int nOut, nIndex;
+	do
+	{
+		nOut = AtomicGet (&m_nReadyOut);
+		if (nOut == AtomicGet (&m_nReadyIn))
+		{
+			return -1;
+		}
+
+		nIndex = AtomicGet (&m_ReadyQueue[nOut]);
+	}
+	while (AtomicCompareExchange (&m_nReadyOut, nOut, (nOut + 1) % ReadyQueueSize) != nOut);
+
+	return nIndex;
+}
+
+void CCameraDevice::QueueBuffer (CCameraBuffer *pBuffer)
+{
+	assert (pBuffer);
+
+	int nRefCount = AtomicDecrement (&pBuffer->m_nRefCount);
+	assert (nRefCount >= 0);
+	if (nRefCount > 0)
+	{
+		return;				// still used by another consumer
+	}
+
+	// Older frames, which have been held for a while, would disturb the controls.
+	// The frame is metered on this core, while the controls are written via I2C,
+	// which is used from core 0 only. A frame is skipped, if the metering of the
+	// previous one has not been applied yet.
+	if (   pBuffer == m_pLastDequeued
+	    &&    AtomicCompareExchange (&m_nAutoControlsState, AutoControlsIdle,
+					 AutoControlsMetering)
+	       == AutoControlsIdle)
+	{
+		AtomicSet (&m_nAutoControlsState,   MeterFrame (pBuffer)
+						  ? AutoControlsPending : AutoControlsIdle);
+	}
+
+	PutFreeBuffer (pBuffer);
+
+	UpdatePendingAutoControls ();
+}
+
+// Applies the metering of a frame, which may have been returned on another core, to
+// the auto controls.
+void CCameraDevice::UpdatePendingAutoControls (void)
+{
+	if (   THIS_CORE () != 0
+	    || AtomicGet (&m_nAutoControlsState) != AutoControlsPending)
+	{
+		return;
+	}
+
+	UpdateAutoControls ();
+
+	AtomicSet (&m_nAutoControlsState, AutoControlsIdle);
+}
+
+bool CCameraDevice::MeterFrame (const CCameraBuffer *pBuffer)
+{
+	(void) pBuffer;
+
+	return false;
+}
+
+void CCameraDevice::UpdateAutoControls (void)
+{
 }
 
 void CCameraDevice::FlushBuffers (void)
 {
-	AtomicSet (&m_nOutPtr, AtomicGet (&m_nInPtr));
+	// Only the reference of GetNextBuffer() is dropped. A buffer, which is still
+	// referenced by other consumers, is returned, when they have finished.
+	CCameraBuffer *pBuffer = m_pNextBuffer;
+	if (pBuffer)
+	{
+		m_pNextBuffer = nullptr;
+
+		QueueBuffer (pBuffer);
+		AtomicIncrement (&m_nFramesDroppedFlush);
+	}
+
+	int nIndex;
+	while ((nIndex = PopReadyBuffer ()) >= 0)
+	{
+		PutFreeBuffer (m_pBuffer[nIndex]);
+		AtomicIncrement (&m_nFramesDroppedFlush);
+	}
+}
+
+// The queue depth values are written from the interrupt handler on core 0 only and
+// are read with IRQs disabled, so that they are consistent, if called on core 0. The
+// other counters are read one by one and may differ by a frame, which is handled
+// meanwhile.
+void CCameraDevice::GetFrameStatistics (TFrameStatistics *pStatistics) const
+{
+	assert (pStatistics);
+
+	EnterCritical (IRQ_LEVEL);
+
+	pStatistics->FramesReceived = m_nFramesReceived;
+	pStatistics->FramesDelivered = m_nFramesDelivered;
+	pStatistics->FramesDroppedNoBuffer = m_nFramesDroppedNoBuffer;
+	pStatistics->FramesDroppedFlush = m_nFramesDroppedFlush;
+	pStatistics->FramesOverwritten = m_nFramesOverwritten;
+
+	unsigned nSamples = m_nQueueDepthSamples;
+	pStatistics->QueueDepthMin = nSamples ? m_nQueueDepthMin : 0;
+	pStatistics->QueueDepthAvg = nSamples ? (float) m_nQueueDepthSum / nSamples : 0.0f;
+	pStatistics->QueueDepthMax = m_nQueueDepthMax;
+
+	for (unsigned i = 0; i < TFrameStatistics::LatencyBins; i++)
+	{
+		pStatistics->LatencyHistogram[i] = m_LatencyHistogram[i];
+	}
+
+	LeaveCritical ();
+}
+
+// IRQs are disabled, so that BufferReady() cannot update the queue depth values in
+// between. This is sufficient, because the camera interrupt is handled on core 0.
+void CCameraDevice::ResetFrameStatistics (void)
+{
+	assert (THIS_CORE () == 0);
+
+	EnterCritical (IRQ_LEVEL);
+
+	AtomicSet (&m_nFramesReceived, 0);
+	AtomicSet (&m_nFramesDelivered, 0);
+	AtomicSet (&m_nFramesDroppedNoBuffer, 0);
+	AtomicSet (&m_nFramesDroppedFlush, 0);
+	AtomicSet (&m_nFramesOverwritten, 0);
+
+	m_nQueueDepthSamples = 0;
+	m_nQueueDepthSum = 0;
+	m_nQueueDepthMin = 0;
+	m_nQueueDepthMax = 0;
+
+	for (unsigned i = 0; i < TFrameStatistics::LatencyBins; i++)
+	{
+		AtomicSet (&m_LatencyHistogram[i], 0);
+	}
+
+	LeaveCritical ();
+}
+
+void CCameraDevice::SetQueuePolicy (TQueuePolicy Policy)
+{
+	assert (Policy < QueueUnknown);
+	m_QueuePolicy = Policy;
+}
+
+CCameraDevice::TQueuePolicy CCameraDevice::GetQueuePolicy (void) const
+{
+	return m_QueuePolicy;
+}
+
+unsigned CCameraDevice::GetBufferIndex (const CCameraBuffer *pBuffer) const
+{
+	assert (pBuffer);
+
+	for (unsigned i = 0; i < m_nBuffers; i++)
+	{
+		if (m_pBuffer[i] == pBuffer)
+		{
+			return i;
+		}
+	}
+
+	assert (0);
+	return 0;
 }
 
 void CCameraDevice::RegisterBufferReadyHandler (TBufferReadyHandler *pHandler, void *pParam)
@@ -151,6 +603,150 @@ void CCameraDevice::RegisterBufferReadyHandler (TBufferReadyHandler *pHandler, v
 	m_pBufferReadyHandler = pHandler;
 }
 
+void CCameraDevice::SetGamma (float fGamma)
+{
+	assert (fGamma > 0.0f);
+
+	for (unsigned i = 0; i < ToneCurveSize; i++)
+	{
+		if (fGamma == 1.0f)
+		{
+			m_ToneCurve[i] = i >> 4;	// exactly like the linear shift
+		}
+		else
+		{
+			float fValue = 255.0f * powf ((float) i / (ToneCurveSize-1), 1.0f / fGamma);
+
+			m_ToneCurve[i] = (u8) (fValue + 0.5f);
+		}
+	}
+
+	m_nToneCurveGeneration++;
+}
+
+void CCameraDevice::SetWhiteBalance (const unsigned pFactor[3])
+{
+	assert (pFactor);
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		m_WhiteBalance[i] = pFactor[i];
+	}
+}
+
+void CCameraDevice::GetWhiteBalance (unsigned pFactor[3]) const
+{
+	assert (pFactor);
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		pFactor[i] = m_WhiteBalance[i];
+	}
+}
+
+// Exponential smoothing prevents flicker from frame to frame. The step is rounded
+// away from zero, so that the factors reach the given ones finally.
+void CCameraDevice::AdjustWhiteBalance (const unsigned pFactor[3])
+{
+	assert (pFactor);
+
+	const int nRound = WhiteBalanceSmoothing - 1;
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		int nDelta = (int) pFactor[i] - (int) m_WhiteBalance[i];
+
+		m_WhiteBalance[i] += (nDelta + (nDelta > 0 ? nRound : -nRound))
+				     / (int) WhiteBalanceSmoothing;
+	}
+}
+
+void CCameraDevice::SetBlackLevel (unsigned nLevel)
+{
+	assert (nLevel < 1024);
+	m_nBlackLevel = nLevel;
+}
+
+unsigned CCameraDevice::GetBlackLevel (void) const
+{
+	return m_nBlackLevel;
+}
+
+void CCameraDevice::SetLensShading (const TLensShading *pTable)
+{
+	if (pTable)
+	{
+		m_LensShading = *pTable;
+	}
+
+	m_bLensShading = !!pTable;
+}
+
+const CCameraDevice::TLensShading *CCameraDevice::GetLensShading (void) const
+{
+	return m_bLensShading ? &m_LensShading : nullptr;
+}
+
+unsigned CCameraDevice::DetectDefects (CCameraBuffer *pBuffer, unsigned nThreshold)
+{
+	assert (pBuffer);
+	pBuffer->FindDefects (nThreshold, this);
+
+	return m_nDefects;
+}
+
+bool CCameraDevice::AddDefect (unsigned x, unsigned y)
+{
+	assert (x <= 0xFFFF && y <= 0xFFFF);
+
+	if (m_nDefects >= MaxDefects)
+	{
+		return false;
+	}
+
+	m_Defect[m_nDefects].x = x;
+	m_Defect[m_nDefects].y = y;
+	m_nDefects++;
+
+	return true;
+}
+
+void CCameraDevice::ClearDefects (void)
+{
+	m_nDefects = 0;
+}
+
+unsigned CCameraDevice::GetDefectCount (void) const
+{
+	return m_nDefects;
+}
+
+void CCameraDevice::SetColorMatrix (const TColorMatrix *pMatrix)
+{
+	if (pMatrix)
+	{
+		m_ColorMatrix = *pMatrix;
+	}
+
+	m_bColorMatrix = !!pMatrix;
+}
+
+const CCameraDevice::TColorMatrix *CCameraDevice::GetColorMatrix (void) const
+{
+	return m_bColorMatrix ? &m_ColorMatrix : nullptr;
+}
+
+void CCameraDevice::SetDemosaicMethod (TDemosaicMethod Method)
+{
+	assert (Method < DemosaicUnknown);
+	m_DemosaicMethod = Method;
+}
+
+CCameraDevice::TDemosaicMethod CCameraDevice::GetDemosaicMethod (void) const
+{
+	return m_DemosaicMethod;
+}
+
 CString CCameraDevice::FormatToString (TFormatCode Format)
 {
 	static const char s_ColorComponents[] = "RGGB";		// must match TColorComponent
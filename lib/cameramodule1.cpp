@@ -82,6 +82,8 @@
 #define OV5647_EXPOSURE_DEFAULT		1000
 #define OV5647_EXPOSURE_MAX		65535
 
+#define OV5647_BLACK_LEVEL		64	// for 10-bit values
+
 LOGMODULE ("camera1");
 
 static const char DeviceName[] = "cam1";
@@ -96,6 +98,8 @@ CCameraModule1::CCameraModule1 (CInterruptSystem *pInterrupt)
 	m_LogicalFormat (FormatUnknown),
 	m_bIgnoreErrors (false)
 {
+	SetBlackLevel (OV5647_BLACK_LEVEL);
+	SetColorMatrix (&s_ColorMatrix);
 }
 
 CCameraModule1::~CCameraModule1 (void)
@@ -334,7 +338,7 @@ void CCameraModule1::Stop (void)
 	LOGDBG ("Streaming stopped");
 }
 
-bool CCameraModule1::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth)
+bool CCameraModule1::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth, bool bPacked)
 {
 	assert (pWidth);
 	assert (pHeight);
@@ -360,7 +364,7 @@ bool CCameraModule1::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDep
 
 	SetupControls ();
 
-	if (!SetupFormat (nDepth))
+	if (!SetupFormat (nDepth, bPacked))
 	{
 		m_pMode = nullptr;
 
@@ -388,7 +392,7 @@ const CCameraDevice::TRect CCameraModule1::GetCropInfo (void) const
 	return m_pMode->Crop;
 }
 
-bool CCameraModule1::SetupFormat (unsigned nDepth)
+bool CCameraModule1::SetupFormat (unsigned nDepth, bool bPacked)
 {
 	unsigned nIndex =   (m_Control[ControlVFlip].GetValue () ? 2 : 0)
 			  | (m_Control[ControlHFlip].GetValue () ? 1 : 0);
@@ -396,7 +400,7 @@ bool CCameraModule1::SetupFormat (unsigned nDepth)
 	if (nDepth == 10)
 	{
 		m_PhysicalFormat = s_Formats[1][nIndex];
-		m_LogicalFormat = s_Formats[0][nIndex];
+		m_LogicalFormat = bPacked ? m_PhysicalFormat : s_Formats[0][nIndex];
 	}
 	else
 	{
@@ -513,7 +517,8 @@ bool CCameraModule1::SetControlValue (TControl Control, int nValue)
 		      && WriteReg8 (OV5647_REG_HFLIP, nValue ? uchBuffer & ~2 : uchBuffer | 2);
 		if (bOK)
 		{
-			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat));
+			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat),
+					   IsFormatPacked (m_LogicalFormat));
 		}
 		break;
 
@@ -523,7 +528,8 @@ bool CCameraModule1::SetControlValue (TControl Control, int nValue)
 		      && WriteReg8 (OV5647_REG_VFLIP, nValue ? uchBuffer | 2 : uchBuffer & ~2 );
 		if (bOK)
 		{
-			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat));
+			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat),
+					   IsFormatPacked (m_LogicalFormat));
 		}
 		break;
 
@@ -640,13 +646,13 @@ bool CCameraModule1::WriteRegs (const TReg *pRegs)
 const CCameraDevice::TFormatCode CCameraModule1::s_Formats[][4] =
 {
 	{
-		// logical only
+		// logical only (unpacked)
 		FormatSGBRG10,
 		FormatSBGGR10,
 		FormatSRGGB10,
 		FormatSGRBG10,
 	}, {
-		// physical only
+		// physical, logical when packed
 		FormatSGBRG10P,
 		FormatSBGGR10P,
 		FormatSRGGB10P,
@@ -654,6 +660,15 @@ const CCameraDevice::TFormatCode CCameraModule1::s_Formats[][4] =
 	}
 };
 
+// Default color correction matrix for the OV5647 with daylight (about 5000K),
+// each row sums up to 1.0 to keep the white balance
+const CCameraDevice::TColorMatrix CCameraModule1::s_ColorMatrix =
+{{
+	{ 1698, -442, -232},
+	{ -382, 1696, -290},
+	{  -52, -843, 1919}
+}};
+
 // Mode configs
 const CCameraModule1::TModeInfo CCameraModule1::s_Modes[] =
 {
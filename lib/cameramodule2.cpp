@@ -71,6 +71,9 @@
 #define IMX219_PPL_MAX			0x7ff0
 #define IMX219_REG_HTS			0x0162
 
+/* Black level for 10-bit values */
+#define IMX219_BLACK_LEVEL		64
+
 /* Exposure control */
 #define IMX219_REG_EXPOSURE		0x015a
 #define IMX219_EXPOSURE_MIN		4
@@ -94,6 +97,16 @@
 
 #define IMX219_REG_ORIENTATION		0x0172
 
+/* Software auto exposure / gain / white balance */
+#define AUTO_TARGET_LEVEL		0.18f	/* mean luminance relative to full scale */
+#define AUTO_TOLERANCE			0.08f	/* no change inside of this relative range */
+#define AUTO_MAX_STEP			4.0f	/* max. change per step */
+#define AUTO_MAX_SATURATED		50	/* reduce, if more than 1 / x quads saturated */
+#define AUTO_SETTLE_FRAMES		2	/* until new settings are effective */
+#define AUTO_SAMPLES_X			80	/* sampled quads per line (approximately) */
+#define AUTO_ZONES_X			16
+#define AUTO_ZONES_Y			12
+
 /* Test Pattern Control */
 #define IMX219_REG_TEST_PATTERN		0x0600
 #define IMX219_TEST_PATTERN_DISABLE	0
@@ -135,8 +148,12 @@ CCameraModule2::CCameraModule2 (CInterruptSystem *pInterrupt)
 	m_pMode (nullptr),
 	m_PhysicalFormat (FormatUnknown),
 	m_LogicalFormat (FormatUnknown),
-	m_bIgnoreErrors (false)
+	m_bIgnoreErrors (false),
+	m_nAutoSettleSequence (0),
+	m_nMeteredSequence (0)
 {
+	SetBlackLevel (IMX219_BLACK_LEVEL);
+	SetColorMatrix (&s_ColorMatrix);
 }
 
 CCameraModule2::~CCameraModule2 (void)
@@ -308,6 +325,8 @@ bool CCameraModule2::Start (bool bLEDOn)
 		return false;
 	}
 
+	m_nAutoSettleSequence = 0;
+
 	if (!WriteReg (IMX219_REG_MODE_SELECT, 1, IMX219_MODE_STREAMING))
 	{
 		LOGWARN ("Cannot select streaming mode");
@@ -334,7 +353,7 @@ void CCameraModule2::Stop (void)
 	LOGDBG ("Streaming stopped");
 }
 
-bool CCameraModule2::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth)
+bool CCameraModule2::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDepth, bool bPacked)
 {
 	assert (pWidth);
 	assert (pHeight);
@@ -360,7 +379,7 @@ bool CCameraModule2::SetMode (unsigned *pWidth, unsigned *pHeight, unsigned nDep
 
 	SetupControls ();
 
-	if (!SetupFormat (nDepth))
+	if (!SetupFormat (nDepth, bPacked))
 	{
 		m_pMode = nullptr;
 
@@ -388,7 +407,7 @@ const CCameraDevice::TRect CCameraModule2::GetCropInfo (void) const
 	return m_pMode->Crop;
 }
 
-bool CCameraModule2::SetupFormat (unsigned nDepth)
+bool CCameraModule2::SetupFormat (unsigned nDepth, bool bPacked)
 {
 	unsigned nIndex =   (m_Control[ControlVFlip].GetValue () ? 2 : 0)
 			  | (m_Control[ControlHFlip].GetValue () ? 1 : 0);
@@ -401,7 +420,7 @@ bool CCameraModule2::SetupFormat (unsigned nDepth)
 	else if (nDepth == 10)
 	{
 		m_PhysicalFormat = s_Formats[2][nIndex];
-		m_LogicalFormat = s_Formats[1][nIndex];
+		m_LogicalFormat = bPacked ? m_PhysicalFormat : s_Formats[1][nIndex];
 	}
 	else
 	{
@@ -434,6 +453,10 @@ void CCameraModule2::SetupControls (void)
 	m_Control[ControlDigitalGain].Setup (IMX219_DGTL_GAIN_MIN, IMX219_DGTL_GAIN_MAX,
 					     IMX219_DGTL_GAIN_STEP, IMX219_DGTL_GAIN_DEFAULT);
 
+	m_Control[ControlAutoExposure].Setup (false, true, 1, false);
+	m_Control[ControlAutoGain].Setup (false, true, 1, false);
+	m_Control[ControlAutoWhiteBalance].Setup (false, true, 1, false);
+
 	m_Control[ControlVFlip].Setup (false, true, 1, false);
 	m_Control[ControlHFlip].Setup (false, true, 1, false);
 
@@ -511,7 +534,8 @@ bool CCameraModule2::SetControlValue (TControl Control, int nValue)
 							   | m_Control[ControlHFlip].GetValue ());
 		if (bOK)
 		{
-			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat));
+			bOK = SetupFormat (GetFormatDepth (m_LogicalFormat),
+					   IsFormatPacked (m_LogicalFormat));
 		}
 		break;
 
@@ -528,6 +552,15 @@ bool CCameraModule2::SetControlValue (TControl Control, int nValue)
 		bOK = WriteReg (IMX219_REG_DIGITAL_GAIN, 2, nValue);
 		break;
 
+	case ControlAutoExposure:
+	case ControlAutoGain:
+		m_nAutoSettleSequence = GetCurrentSequence ();
+		// fall through
+
+	case ControlAutoWhiteBalance:
+		bOK = true;			// done in software in UpdateAutoControls()
+		break;
+
 	case ControlTestPattern:
 		bOK = WriteReg (IMX219_REG_TEST_PATTERN, 2, nValue);
 		break;
@@ -570,6 +603,189 @@ CCameraControl::TControlInfo CCameraModule2::GetControlInfo (TControl Control) c
 	return m_Control[Control].GetInfo ();
 }
 
+// All automatic controls share one statistics pass over the processed frame. This
+// may run on any core and does not access the sensor.
+bool CCameraModule2::MeterFrame (const CCameraBuffer *pBuffer)
+{
+	assert (pBuffer);
+
+	const bool bAutoExposure = !!m_Control[ControlAutoExposure].GetValue ();
+	const bool bAutoGain = !!m_Control[ControlAutoGain].GetValue ();
+	const bool bAutoWhiteBalance = !!m_Control[ControlAutoWhiteBalance].GetValue ();
+
+	// The frame was taken with the previous exposure settings? This depends on
+	// the sequence number, because more frames may have been captured meanwhile.
+	const bool bSettling = (int) (pBuffer->GetSequenceNumber () - m_nAutoSettleSequence) < 0;
+
+	const bool bUpdateExposure = (bAutoExposure || bAutoGain) && !bSettling;
+	if (!bUpdateExposure && !bAutoWhiteBalance)
+	{
+		return false;
+	}
+
+	assert (m_pMode);
+	unsigned nStride = m_pMode->Width / 2 / AUTO_SAMPLES_X;
+
+	m_Statistics.Bins = 1;
+	m_Statistics.Stride = nStride ? nStride : 1;
+	m_Statistics.ZonesX = AUTO_ZONES_X;
+	m_Statistics.ZonesY = AUTO_ZONES_Y;
+	pBuffer->GetStatistics (&m_Statistics);
+
+	m_nMeteredSequence = pBuffer->GetSequenceNumber ();
+
+	return true;
+}
+
+// Applies the statistics from MeterFrame() on core 0. The settings may have been
+// changed meanwhile, so that the settle state is checked again.
+void CCameraModule2::UpdateAutoControls (void)
+{
+	const bool bAutoExposure = !!m_Control[ControlAutoExposure].GetValue ();
+	const bool bAutoGain = !!m_Control[ControlAutoGain].GetValue ();
+	const bool bAutoWhiteBalance = !!m_Control[ControlAutoWhiteBalance].GetValue ();
+
+	const bool bSettling = (int) (m_nMeteredSequence - m_nAutoSettleSequence) < 0;
+	const bool bUpdateExposure = (bAutoExposure || bAutoGain) && !bSettling;
+
+	if (bAutoWhiteBalance)
+	{
+		unsigned Factor[3];
+		if (CCameraBuffer::EstimateWhiteBalance (m_Statistics,
+				GetBlackLevel () >> (10 - m_Statistics.Depth), Factor))
+		{
+			AdjustWhiteBalance (Factor);
+		}
+	}
+
+	if (bUpdateExposure)
+	{
+		UpdateExposure (bAutoExposure, bAutoGain);
+	}
+}
+
+// Meters the center-weighted mean luminance of the raw frame and splits the total
+// exposure, which is needed to reach the target level, between the exposure time,
+// the analog gain and the digital gain (in this order to keep the noise low).
+void CCameraModule2::UpdateExposure (bool bAutoExposure, bool bAutoGain)
+{
+	// the zones in the center half of the frame count twice
+	u64 nSum = 0;
+	unsigned nCount = 0;
+	unsigned nSaturated = 0;
+	for (unsigned y = 0; y < AUTO_ZONES_Y; y++)
+	{
+		for (unsigned x = 0; x < AUTO_ZONES_X; x++)
+		{
+			const CCameraBuffer::TStatistics::TZone &Zone = m_Statistics.Zone[y][x];
+			unsigned nWeight =    AUTO_ZONES_Y / 4 <= y && y < AUTO_ZONES_Y * 3 / 4
+					   && AUTO_ZONES_X / 4 <= x && x < AUTO_ZONES_X * 3 / 4 ? 2 : 1;
+
+			nSum += nWeight * Zone.Sum[3];
+			nCount += nWeight * Zone.Count;
+			nSaturated += Zone.Saturated;
+		}
+	}
+
+	if (!nCount)
+	{
+		return;
+	}
+
+	// relative to the range above the black level
+	const unsigned nBlackLevel = GetBlackLevel () >> (10 - m_Statistics.Depth);
+	float fLevel =   ((float) nSum / nCount - nBlackLevel)
+		       / ((1 << m_Statistics.Depth) - 1 - nBlackLevel);
+	float fRatio = fLevel > 0.0f ? AUTO_TARGET_LEVEL / fLevel : AUTO_MAX_STEP;
+	if (fRatio > AUTO_MAX_STEP)
+	{
+		fRatio = AUTO_MAX_STEP;
+	}
+	else if (fRatio < 1.0f / AUTO_MAX_STEP)
+	{
+		fRatio = 1.0f / AUTO_MAX_STEP;
+	}
+
+	// do not brighten the image, if the highlights are clipped already
+	if (   (1.0f - AUTO_TOLERANCE < fRatio && fRatio < 1.0f + AUTO_TOLERANCE)
+	    || (fRatio > 1.0f && nSaturated * AUTO_MAX_SATURATED > m_Statistics.Count))
+	{
+		return;
+	}
+
+	int nExposure = m_Control[ControlExposure].GetValue ();
+	int nAnalogGain = m_Control[ControlAnalogGain].GetValue ();
+	int nDigitalGain = m_Control[ControlDigitalGain].GetValue ();
+
+	// analog gain is 256 / (256 - value), digital gain is value / 256
+	float fTotal = fRatio * nExposure * nDigitalGain / (256 - nAnalogGain);
+
+	if (bAutoExposure)
+	{
+		CCameraControl::TControlInfo Info = m_Control[ControlExposure].GetInfo ();
+
+		nExposure = fTotal + 0.5f;
+		if (nExposure < Info.Min)
+		{
+			nExposure = Info.Min;
+		}
+		else if (nExposure > Info.Max)
+		{
+			nExposure = Info.Max;
+		}
+	}
+
+	if (bAutoGain)
+	{
+		float fGain = fTotal / nExposure;
+
+		nAnalogGain = fGain > 1.0f ? (int) (256.5f - 256.0f / fGain) : IMX219_ANA_GAIN_MIN;
+		if (nAnalogGain > IMX219_ANA_GAIN_MAX)
+		{
+			nAnalogGain = IMX219_ANA_GAIN_MAX;
+		}
+
+		// the digital gain provides the remaining part
+		nDigitalGain = fGain * (256 - nAnalogGain) + 0.5f;
+		if (nDigitalGain < IMX219_DGTL_GAIN_MIN)
+		{
+			nDigitalGain = IMX219_DGTL_GAIN_MIN;
+		}
+		else if (nDigitalGain > IMX219_DGTL_GAIN_MAX)
+		{
+			nDigitalGain = IMX219_DGTL_GAIN_MAX;
+		}
+	}
+
+	const struct
+	{
+		TControl Control;
+		int	 nValue;
+	}
+	Settings[] =
+	{
+		{ControlExposure, nExposure},
+		{ControlAnalogGain, nAnalogGain},
+		{ControlDigitalGain, nDigitalGain}
+	};
+
+	for (const auto &Setting : Settings)
+	{
+		if (m_Control[Setting.Control].GetValue () == Setting.nValue)
+		{
+			continue;
+		}
+
+		if (!SetControlValue (Setting.Control, Setting.nValue))
+		{
+			LOGWARN ("Cannot apply auto control value (%u, %d)",
+				 Setting.Control, Setting.nValue);
+		}
+
+		m_nAutoSettleSequence = GetCurrentSequence () + AUTO_SETTLE_FRAMES;
+	}
+}
+
 bool CCameraModule2::ReadReg (u16 usReg, unsigned nBytes, u16 *pValue)
 {
 	usReg = le2be16 (usReg);
@@ -672,13 +888,13 @@ const CCameraDevice::TFormatCode CCameraModule2::s_Formats[][4] =
 		FormatSGBRG8,
 		FormatSBGGR8,
 	}, {
-		// logical only
+		// logical only (unpacked)
 		FormatSRGGB10,
 		FormatSGRBG10,
 		FormatSGBRG10,
 		FormatSBGGR10,
 	}, {
-		// physical only
+		// physical, logical when packed
 		FormatSRGGB10P,
 		FormatSGRBG10P,
 		FormatSGBRG10P,
@@ -686,6 +902,17 @@ const CCameraDevice::TFormatCode CCameraModule2::s_Formats[][4] =
 	}
 };
 
+/*
+ * Default color correction matrix for the IMX219 with daylight (about 5000K),
+ * each row sums up to 1.0 to keep the white balance
+ */
+const CCameraDevice::TColorMatrix CCameraModule2::s_ColorMatrix =
+{{
+	{ 2126, -773, -329},
+	{ -507, 2266, -735},
+	{ -148, -849, 2021}
+}};
+
 /* Mode configs */
 const CCameraModule2::TModeInfo CCameraModule2::s_Modes[] =
 {
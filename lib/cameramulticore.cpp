@@ -0,0 +1,138 @@
+//
+// cameramulticore.cpp
+//
+// libcamera - Camera support for Circle
+// Copyright (C) 2022  Rene Stange <rsta2@o2online.de>
+//
+// SPDX-License-Identifier: GPL-2.0
+//
+#include <camera/cameramulticore.h>
+
+#ifdef ARM_ALLOW_MULTI_CORE
+
+#include <circle/synchronize.h>
+#include <circle/atomic.h>
+#include <assert.h>
+
+#define WFE()	asm volatile ("wfe" ::: "memory")
+#define SEV()	asm volatile ("sev" ::: "memory")
+
+CCameraMultiCore *CCameraMultiCore::s_pThis = nullptr;
+
+CCameraMultiCore::CCameraMultiCore (CMemorySystem *pMemorySystem)
+:	CMultiCoreSupport (pMemorySystem),
+	m_pHandler (nullptr),
+	m_pParam (nullptr),
+	m_nRows (0),
+	m_nGeneration (0),
+	m_nPending (0),
+	m_bTerminate (false)
+{
+}
+
+CCameraMultiCore::~CCameraMultiCore (void)
+{
+	s_pThis = nullptr;
+
+	// let the secondary cores return from Run()
+	m_bTerminate = true;
+	DataSyncBarrier ();
+	SEV ();
+}
+
+bool CCameraMultiCore::Initialize (void)
+{
+	if (!CMultiCoreSupport::Initialize ())
+	{
+		return false;
+	}
+
+	assert (!s_pThis);
+	s_pThis = this;
+
+	return true;
+}
+
+void CCameraMultiCore::Execute (TBandHandler *pHandler, void *pParam, unsigned nRows)
+{
+	assert (pHandler);
+
+	if (   ThisCore () != 0
+	    || nRows < CORES * 2)
+	{
+		(*pHandler) (0, nRows, pParam);
+
+		return;
+	}
+
+	m_pHandler = pHandler;
+	m_pParam = pParam;
+	m_nRows = nRows;
+
+	AtomicSet (&m_nPending, CORES-1);
+
+	// publish the job to the secondary cores
+	DataMemBarrier ();
+	AtomicIncrement (&m_nGeneration);
+	DataSyncBarrier ();
+	SEV ();
+
+	ProcessBand (0);
+
+	while (AtomicGet (&m_nPending))
+	{
+		WFE ();
+	}
+
+	DataMemBarrier ();
+}
+
+void CCameraMultiCore::Run (unsigned nCore)
+{
+	assert (1 <= nCore && nCore < CORES);
+
+	int nGeneration = 0;
+	while (!m_bTerminate)
+	{
+		if (AtomicGet (&m_nGeneration) == nGeneration)
+		{
+			WFE ();
+
+			continue;
+		}
+
+		nGeneration = AtomicGet (&m_nGeneration);
+		DataMemBarrier ();
+
+		ProcessBand (nCore);
+
+		DataMemBarrier ();
+		AtomicDecrement (&m_nPending);
+		DataSyncBarrier ();
+		SEV ();
+	}
+}
+
+// The bands start at even rows, so that all bands begin with the same Bayer phase.
+// Each band handler reads up to two rows above and below its band (halo, required
+// by the 5x5 gradient demosaic), which belong to the neighbouring bands. This is
+// safe, because the source frame is read only.
+void CCameraMultiCore::ProcessBand (unsigned nCore)
+{
+	assert (nCore < CORES);
+
+	unsigned nFirstRow = (m_nRows * nCore / CORES) & ~1U;
+	unsigned nLastRow =   nCore < CORES-1
+			    ? (m_nRows * (nCore+1) / CORES) & ~1U
+			    : m_nRows;
+
+	assert (m_pHandler);
+	(*m_pHandler) (nFirstRow, nLastRow, m_pParam);
+}
+
+CCameraMultiCore *CCameraMultiCore::Get (void)
+{
+	return s_pThis;
+}
+
+#endif
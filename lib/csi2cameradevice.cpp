@@ -67,8 +67,10 @@ CCSI2CameraDevice::CCSI2CameraDevice (CInterruptSystem *pInterruptSystem)
 	m_nHeight (0),
 	m_nBytesPerLine (0),
 	m_nImageSize (0),
+	m_nSequence (0),
 	m_pCurrentBuffer (nullptr),
-	m_pDummyBuffer (new u8[4096])
+	m_pDummyBuffer (new u8[4096]),
+	m_bFrameDropped (false)
 {
 }
 
@@ -109,7 +111,8 @@ bool CCSI2CameraDevice::Initialize (void)
 	return true;
 }
 
-bool CCSI2CameraDevice::SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth)
+bool CCSI2CameraDevice::SetFormat (unsigned nWidth, unsigned nHeight, unsigned nDepth,
+				   bool bPacked)
 {
 	if (m_bActive)
 	{
@@ -117,7 +120,7 @@ bool CCSI2CameraDevice::SetFormat (unsigned nWidth, unsigned nHeight, unsigned n
 	}
 
 	// call camera driver
-	if (!SetMode (&nWidth, &nHeight, nDepth))
+	if (!SetMode (&nWidth, &nHeight, nDepth, bPacked))
 	{
 		return false;
 	}
@@ -139,6 +142,11 @@ bool CCSI2CameraDevice::SetFormat (unsigned nWidth, unsigned nHeight, unsigned n
 	{
 		m_nBytesPerLine = __ALIGN (m_nWidth, BPL_ALIGNMENT);
 	}
+	else if (IsFormatPacked (GetLogicalFormat ()))
+	{
+		assert (GetFormatDepth (GetLogicalFormat ()) == 10);
+		m_nBytesPerLine = __ALIGN (m_nWidth * 5 / 4, BPL_ALIGNMENT);	// 4 pixels in 5 bytes
+	}
 	else
 	{
 		assert (GetFormatDepth (GetLogicalFormat ()) == 10);
@@ -186,6 +194,7 @@ bool CCSI2CameraDevice::EnableRX (void)
 	m_bActive = true;
 
 	m_nSequence = 0;
+	m_bFrameDropped = false;
 
 	u8 uchDepth = GetFormatDepth (GetPhysicalFormat ());
 	assert (uchDepth == 8 || uchDepth == 10);
@@ -292,7 +301,8 @@ bool CCSI2CameraDevice::EnableRX (void)
 	// Set packing configuration
 	u32 nUnPack = UNICAM_PUM_NONE;
 	u32 nPack = UNICAM_PPM_NONE;
-	if (uchDepth == 10)
+	if (   uchDepth == 10
+	    && !IsFormatPacked (GetLogicalFormat ()))	// otherwise store as received
 	{
 		nUnPack = UNICAM_PUM_UNPACK10;
 		nPack = UNICAM_PPM_PACK16;		// Repacking to 16bpp
@@ -358,7 +368,17 @@ void CCSI2CameraDevice::DisableRX (void)
 
 	m_bActive = false;
 
-	m_pCurrentBuffer = nullptr;
+	if (m_pCurrentBuffer)
+	{
+		PutFreeBuffer (m_pCurrentBuffer);
+
+		m_pCurrentBuffer = nullptr;
+	}
+}
+
+unsigned CCSI2CameraDevice::GetCurrentSequence (void) const
+{
+	return m_nSequence;
 }
 
 void CCSI2CameraDevice::InterruptHandler (void)
@@ -390,10 +410,18 @@ void CCSI2CameraDevice::InterruptHandler (void)
 			m_pCurrentBuffer->SetFormat (m_nWidth, m_nHeight, m_nBytesPerLine,
 						     GetLogicalFormat ());
 
-			BufferReady (m_nSequence);
+			BufferReady (m_pCurrentBuffer, m_nSequence);
 
 			m_pCurrentBuffer = nullptr;
 		}
+		else if (m_bFrameDropped)
+		{
+			// The frame went into the dummy buffer. Frame ends without a seen
+			// frame start (e.g. after enabling the receiver) are not counted.
+			FrameDropped ();
+
+			m_bFrameDropped = false;
+		}
 
 		m_nSequence++;
 	}
@@ -406,6 +434,8 @@ void CCSI2CameraDevice::InterruptHandler (void)
 			m_pCurrentBuffer = GetFreeBuffer ();
 		}
 
+		m_bFrameDropped = !m_pCurrentBuffer;
+
 		if (m_pCurrentBuffer)
 		{
 			m_pCurrentBuffer->SetTimestamp (  CTimer::Get ()->GetClockTicks ()
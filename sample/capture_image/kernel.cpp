@@ -11,9 +11,18 @@
 #include <camera/camerabuffer.h>
 #include <circle/string.h>
 #include <circle/util.h>
+#include <assert.h>
 
 #define DRIVE		"SD:"
 
+#if DEPTH == 16
+	#define PIXEL_FORMAT	CCameraBuffer::PixelFormatRGB565
+#elif DEPTH == 32
+	#define PIXEL_FORMAT	CCameraBuffer::PixelFormatBGRA8888
+#else
+	#error Screen DEPTH must be 16 or 32!
+#endif
+
 LOGMODULE ("kernel");
 
 CKernel *CKernel::s_pThis = nullptr;
@@ -121,11 +130,14 @@ TShutdownMode CKernel::Run (void)
 	}
 
 	// Set the wanted image format first
-	if (!m_pCamera->SetFormat (WIDTH, HEIGHT))
+	if (!m_pCamera->SetFormat (WIDTH, HEIGHT, BAYER_DEPTH, BAYER_PACKED))
 	{
 		LOGPANIC ("Cannot set format");
 	}
 
+	m_pCamera->SetGamma (GAMMA);
+	m_pCamera->SetDemosaicMethod (DEMOSAIC);
+
 	// Then allocate the image buffers
 	if (!m_pCamera->AllocateBuffers ())
 	{
@@ -139,13 +151,11 @@ TShutdownMode CKernel::Run (void)
 	m_pCamera->SetControlValuePercent (CCameraDevice::ControlExposure, m_nExposure);
 	m_pCamera->SetControlValuePercent (CCameraDevice::ControlAnalogGain, m_nAnalogGain);
 
-	if (m_CameraManager.GetCameraModel () == CCameraManager::CameraModule1)
-	{
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoExposure, AUTO_EXPOSURE);
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoGain, AUTO_GAIN);
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoWhiteBalance, AUTO_WHITE_BALANCE);
-	}
-	else
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoExposure, AUTO_EXPOSURE);
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoGain, AUTO_GAIN);
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoWhiteBalance, AUTO_WHITE_BALANCE);
+
+	if (m_CameraManager.GetCameraModel () == CCameraManager::CameraModule2)
 	{
 		m_pCamera->SetControlValuePercent (CCameraDevice::ControlDigitalGain, m_nDigitalGain);
 	}
@@ -189,30 +199,25 @@ TShutdownMode CKernel::Run (void)
 			pBuffer->WhiteBalance ();
 		}
 
-		// Convert and draw preview image
+		// Convert and draw preview image, binning 4x4 pixels into one
 		static const unsigned nSizeFactor = 4;
-		unsigned x0 = m_Screen.GetWidth () - m_FormatInfo.Width / nSizeFactor;
-		for (unsigned y = 0; y < m_FormatInfo.Height; y += nSizeFactor)
+		unsigned nPreviewWidth = m_FormatInfo.Width / nSizeFactor;
+		unsigned nPreviewHeight = m_FormatInfo.Height / nSizeFactor;
+		if (nPreviewHeight > m_Screen.GetHeight ())
 		{
-			for (unsigned x = 0; x < m_FormatInfo.Width; x += nSizeFactor)
-			{
-#if DEPTH == 16
-				TScreenColor Color = pBuffer->GetPixelRGB565 (x, y);
-#elif DEPTH == 32
-				TScreenColor Color = pBuffer->GetPixelRGB888 (x, y);
-				// convert RGB to BGRA, used on screen
-				Color = COLOR32 (Color & 0xFF,
-						 Color >> 8 & 0xFF,
-						 Color >> 16 & 0xFF,
-						 0xFF);			// alpha channel
-#else
-	#error Screen DEPTH must be 16 or 32!
-#endif
-
-				m_Screen.SetPixel (x0 + x / nSizeFactor, y / nSizeFactor, Color);
-			}
+			nPreviewHeight = m_Screen.GetHeight ();
 		}
 
+		CBcmFrameBuffer *pFrameBuffer = m_Screen.GetFrameBuffer ();
+		assert (pFrameBuffer);
+		u8 *pPreview = (u8 *) (uintptr) pFrameBuffer->GetBuffer ()
+			+ (m_Screen.GetWidth () - nPreviewWidth) * sizeof (TScreenColor);
+
+		CCameraDevice::TRect Rect {0, 0, nPreviewWidth * nSizeFactor,
+					   nPreviewHeight * nSizeFactor};
+		pBuffer->ConvertScaled (pPreview, pFrameBuffer->GetPitch (), PIXEL_FORMAT,
+					nSizeFactor, &Rect);
+
 		m_pCamera->BufferProcessed ();
 
 		switch (m_Action)
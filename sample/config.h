@@ -23,6 +23,9 @@
 #define WIDTH			m_Screen.GetWidth()	// by default use the screen size
 #define HEIGHT			m_Screen.GetHeight()	// will be adjusted to nearest camera format
 
+#define BAYER_DEPTH		10			// 8 halves the buffer size, Camera Module 2 only
+#define BAYER_PACKED		false			// store 10 bits packed (4 pixels in 5 bytes)
+
 #define VFLIP			false			// set both to true, to rotate by 180 degrees
 #define HFLIP			false
 
@@ -31,8 +34,12 @@
 
 #define DIGITAL_GAIN		50			// percent, Camera Module 2 only
 
-#define AUTO_EXPOSURE		true			// Camera Module 1 only
-#define AUTO_GAIN		true			// Camera Module 1 only
-#define AUTO_WHITE_BALANCE	true			// Camera Module 1 only
+#define GAMMA			2.2f			// 1.0f for linear output
+
+#define DEMOSAIC		CCameraDevice::DemosaicBilinear	// or DemosaicGradient (slower)
+
+#define AUTO_EXPOSURE		true
+#define AUTO_GAIN		true
+#define AUTO_WHITE_BALANCE	true
 
 #endif
@@ -10,6 +10,14 @@
 #include "../config.h"
 #include <camera/camerabuffer.h>
 
+#if DEPTH == 16
+	#define PIXEL_FORMAT	CCameraBuffer::PixelFormatRGB565
+#elif DEPTH == 32
+	#define PIXEL_FORMAT	CCameraBuffer::PixelFormatBGRA8888
+#else
+	#error Screen DEPTH must be 16 or 32!
+#endif
+
 LOGMODULE ("kernel");
 
 CKernel::CKernel (void)
@@ -77,11 +85,17 @@ TShutdownMode CKernel::Run (void)
 	assert (m_pCamera);
 
 	// Set the wanted image format first
-	if (!m_pCamera->SetFormat (WIDTH, HEIGHT))
+	if (!m_pCamera->SetFormat (WIDTH, HEIGHT, BAYER_DEPTH, BAYER_PACKED))
 	{
 		LOGPANIC ("Cannot set format");
 	}
 
+	m_pCamera->SetGamma (GAMMA);
+	m_pCamera->SetDemosaicMethod (DEMOSAIC);
+
+	// Always show the most recent image, if the conversion is slower than the camera
+	m_pCamera->SetQueuePolicy (CCameraDevice::QueueLatest);
+
 	// Then allocate the image buffers
 	if (!m_pCamera->AllocateBuffers ())
 	{
@@ -95,13 +109,11 @@ TShutdownMode CKernel::Run (void)
 	m_pCamera->SetControlValuePercent (CCameraDevice::ControlExposure, EXPOSURE);
 	m_pCamera->SetControlValuePercent (CCameraDevice::ControlAnalogGain, ANALOG_GAIN);
 
-	if (m_CameraManager.GetCameraModel () == CCameraManager::CameraModule1)
-	{
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoExposure, AUTO_EXPOSURE);
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoGain, AUTO_GAIN);
-		m_pCamera->SetControlValue (CCameraDevice::ControlAutoWhiteBalance, AUTO_WHITE_BALANCE);
-	}
-	else
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoExposure, AUTO_EXPOSURE);
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoGain, AUTO_GAIN);
+	m_pCamera->SetControlValue (CCameraDevice::ControlAutoWhiteBalance, AUTO_WHITE_BALANCE);
+
+	if (m_CameraManager.GetCameraModel () == CCameraManager::CameraModule2)
 	{
 		m_pCamera->SetControlValuePercent (CCameraDevice::ControlDigitalGain, DIGITAL_GAIN);
 	}
@@ -141,20 +153,11 @@ TShutdownMode CKernel::Run (void)
 		// Ignore the first frames, because they may contain invalid data
 		if (pBuffer->GetSequenceNumber () > 5)
 		{
-			// Convert and draw image
-			for (unsigned y = 0; y < nMinHeight; y++)
-			{
-				for (unsigned x = 0; x < nMinWidth; x++)
-				{
-					u32 nColor = pBuffer->GetPixelRGB888 (x, y);
-					// Convert to logical screen color
-					T2DColor Color = COLOR2D (nColor & 0xFF,
-								  nColor >> 8 & 0xFF,
-								  nColor >> 16 & 0xFF);
-
-					m_Screen.DrawPixel (x, y, Color);
-				}
-			}
+			// Convert image directly into the display buffer
+			CCameraDevice::TRect Rect {0, 0, nMinWidth, nMinHeight};
+			pBuffer->Convert (m_Screen.GetBuffer (),
+					  m_Screen.GetWidth () * sizeof (T2DColor),
+					  PIXEL_FORMAT, &Rect);
 		}
 
 		// Free the buffer to be reused
@@ -174,6 +177,15 @@ TShutdownMode CKernel::Run (void)
 	float fSeconds = (float) (nEndTicks - nStartTicks) / CLOCKHZ;
 	LOGNOTE ("Frame rate was %.1f Hz", nFrames / fSeconds);
 
+	// Show the frame delivery counters of the camera
+	CCameraDevice::TFrameStatistics Stats;
+	m_pCamera->GetFrameStatistics (&Stats);
+	LOGNOTE ("%u frames received, %u delivered, %u dropped, %u overwritten",
+		 Stats.FramesReceived, Stats.FramesDelivered,
+		 Stats.FramesDroppedNoBuffer, Stats.FramesOverwritten);
+	LOGNOTE ("Queue depth was %u .. %u (%.1f on average)",
+		 Stats.QueueDepthMin, Stats.QueueDepthMax, Stats.QueueDepthAvg);
+
 	// Stop the camera
 	m_pCamera->Stop ();
 